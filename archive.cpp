@@ -0,0 +1,315 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <llvm/Object/ObjectFile.h>
+#include <llvm/Object/SymbolicFile.h>
+#include <llvm/Support/Endian.h>
+
+#include "bc2obj.h"
+
+namespace {
+
+const size_t HeaderSize = 60;
+
+void addField(std::string &Header, const std::string &Val, size_t Width) {
+  Header += Val.substr(0, Width);
+  Header.append(Width - std::min(Val.size(), Width), ' ');
+}
+
+// Deterministic member header, like "llvm-ar rcsD" writes it.
+
+std::string getMemberHeader(const std::string &Name, uint64_t Size) {
+  std::string Header;
+
+  addField(Header, Name, 16);
+  addField(Header, "0", 12);
+  addField(Header, "0", 6);
+  addField(Header, "0", 6);
+  addField(Header, "644", 8);
+  addField(Header, std::to_string(Size), 10);
+  Header += "`\n";
+
+  return Header;
+}
+
+void getSymbols(const ArchiveMember &Member,
+                std::vector<std::string> &Symbols) {
+  if (!Member.Symbols.empty()) {
+    Symbols = Member.Symbols;
+    return;
+  }
+
+  // Objects that didn't go through LTOModule (native objects and
+  // cached objects), read their symbol table.
+#if LLVM_VERSION_GE(3, 6)
+  MemoryBufferRef Buf(Member.Data, Member.Name);
+  auto Obj = object::SymbolicFile::createSymbolicFile(Buf);
+
+  if (Obj.getError())
+    return;
+
+  for (auto &Sym : (*Obj)->symbols()) {
+    uint32_t Flags = Sym.getFlags();
+
+    if (!(Flags & object::BasicSymbolRef::SF_Global) ||
+        (Flags & object::BasicSymbolRef::SF_Undefined) ||
+        (Flags & object::BasicSymbolRef::SF_FormatSpecific))
+      continue;
+
+    std::string Name;
+    raw_string_ostream OS(Name);
+
+    if (Sym.printName(OS))
+      continue;
+
+    Symbols.push_back(OS.str());
+  }
+#else
+  std::unique_ptr<MemoryBuffer> Buf(
+      MemoryBuffer::getMemBuffer(Member.Data, Member.Name, false));
+  auto Obj = object::ObjectFile::createObjectFile(Buf); // takes over Buf
+
+  if (Obj.getError())
+    return;
+
+  std::unique_ptr<object::ObjectFile> File(Obj.get());
+
+  for (auto Sym = File->symbol_begin(); Sym != File->symbol_end(); ++Sym) {
+    uint32_t Flags = Sym->getFlags();
+
+    if (!(Flags & object::BasicSymbolRef::SF_Global) ||
+        (Flags & object::BasicSymbolRef::SF_Undefined) ||
+        (Flags & object::BasicSymbolRef::SF_FormatSpecific))
+      continue;
+
+    StringRef Name;
+
+    if (Sym->getName(Name))
+      continue;
+
+    Symbols.push_back(Name.str());
+  }
+#endif
+}
+
+bool isBSDFormat(const std::vector<ArchiveMember> &Members) {
+  for (auto &Member : Members) {
+    switch (sys::fs::identify_magic(Member.Data)) {
+    case sys::fs::file_magic::macho_object:
+    case sys::fs::file_magic::macho_universal_binary:
+      return true;
+    case sys::fs::file_magic::unknown:
+    case sys::fs::file_magic::bitcode:
+      continue;
+    default:
+      return false;
+    }
+  }
+
+  return false;
+}
+
+} // end unnamed namespace
+
+bool writeArchive(const std::string &Path,
+                  const std::vector<ArchiveMember> &Members) {
+  bool BSD = isBSDFormat(Members);
+  std::vector<std::vector<std::string>> Symbols(Members.size());
+  std::vector<std::string> Headers(Members.size());
+  std::vector<uint64_t> Offsets(Members.size());
+  std::string LongNames;
+  size_t NumSymbols = 0;
+  size_t SymNamesSize = 0;
+
+  for (size_t I = 0; I < Members.size(); ++I) {
+    getSymbols(Members[I], Symbols[I]);
+    NumSymbols += Symbols[I].size();
+
+    for (auto &Sym : Symbols[I])
+      SymNamesSize += Sym.size() + 1;
+  }
+
+  // Symbol table
+
+  std::string SymTab;
+
+  if (BSD) {
+    SymTab.resize(4 + NumSymbols * 8 + 4);
+    SymTab.append(SymNamesSize, '\0');
+    SymTab.resize((SymTab.size() + 7) & ~7);
+  } else {
+    SymTab.resize(4 + NumSymbols * 4);
+    SymTab.append(SymNamesSize, '\0');
+  }
+
+  uint64_t Offset = 8;
+
+  if (NumSymbols) {
+    Offset += HeaderSize + SymTab.size();
+    Offset += Offset & 1;
+  }
+
+  // Member names go into the header (or the long name table)
+
+  std::vector<std::string> BSDNames(Members.size());
+
+  if (!BSD) {
+    for (size_t I = 0; I < Members.size(); ++I) {
+      const std::string &Name = Members[I].Name;
+
+      if (Name.size() < 16) {
+        Headers[I] = Name + "/";
+      } else {
+        Headers[I] = "/" + std::to_string(LongNames.size());
+        LongNames += Name;
+        LongNames += "/\n";
+      }
+    }
+
+    if (!LongNames.empty()) {
+      Offset += HeaderSize + LongNames.size();
+      Offset += Offset & 1;
+    }
+  }
+
+  for (size_t I = 0; I < Members.size(); ++I) {
+    uint64_t Size = Members[I].Data.size();
+    Offsets[I] = Offset;
+
+    if (BSD) {
+      // Keep the object data 8-byte aligned.
+      std::string &Name = BSDNames[I];
+      Name = Members[I].Name;
+      Name.append(8 - (Offset + HeaderSize + Name.size()) % 8, '\0');
+      Size += Name.size();
+      Headers[I] = getMemberHeader("#1/" + std::to_string(Name.size()), Size);
+    } else {
+      Headers[I] = getMemberHeader(Headers[I], Size);
+    }
+
+    Offset += HeaderSize + Size;
+    Offset += Offset & 1;
+  }
+
+  if (Offset > UINT32_MAX) {
+    errmsg(Path << ": archive too large");
+    return false;
+  }
+
+  // Fill in the symbol table now that the member offsets are known
+
+  char *Ptr = &SymTab[0];
+  char *Names = Ptr + SymTab.size() - SymNamesSize;
+  size_t NameOffset = 0;
+
+  if (BSD) {
+    Names = Ptr + 4 + NumSymbols * 8 + 4;
+    support::endian::write32le(Ptr, NumSymbols * 8);
+    Ptr += 4;
+  } else {
+    support::endian::write32be(Ptr, NumSymbols);
+    Ptr += 4;
+  }
+
+  for (size_t I = 0; I < Members.size(); ++I) {
+    for (auto &Sym : Symbols[I]) {
+      if (BSD) {
+        support::endian::write32le(Ptr, NameOffset);
+        support::endian::write32le(Ptr + 4, Offsets[I]);
+        Ptr += 8;
+      } else {
+        support::endian::write32be(Ptr, Offsets[I]);
+        Ptr += 4;
+      }
+
+      memcpy(Names + NameOffset, Sym.c_str(), Sym.size() + 1);
+      NameOffset += Sym.size() + 1;
+    }
+  }
+
+  if (BSD)
+    support::endian::write32le(Ptr, SymTab.size() - (Ptr + 4 - &SymTab[0]));
+
+  // Write everything out
+
+  std::string Model = Path + ".tmp-%%%%%%";
+  SmallString<128> TmpPath;
+  int fd;
+
+  if (sys::fs::createUniqueFile(Model, fd, TmpPath)) {
+    errmsg(Path << ": cannot open file for writing");
+    return false;
+  }
+
+  const char Pad = '\n';
+  bool OK = writeAll(fd, "!<arch>\n", 8);
+
+  if (OK && NumSymbols) {
+    std::string Header =
+        getMemberHeader(BSD ? "__.SYMDEF" : "/", SymTab.size());
+    OK = writeAll(fd, Header.data(), Header.size()) &&
+         writeAll(fd, SymTab.data(), SymTab.size()) &&
+         (!(SymTab.size() & 1) || writeAll(fd, &Pad, 1));
+  }
+
+  if (OK && !LongNames.empty()) {
+    std::string Header = getMemberHeader("//", LongNames.size());
+    OK = writeAll(fd, Header.data(), Header.size()) &&
+         writeAll(fd, LongNames.data(), LongNames.size()) &&
+         (!(LongNames.size() & 1) || writeAll(fd, &Pad, 1));
+  }
+
+  for (size_t I = 0; OK && I < Members.size(); ++I) {
+    StringRef Data = Members[I].Data;
+
+    OK = writeAll(fd, Headers[I].data(), Headers[I].size()) &&
+         writeAll(fd, BSDNames[I].data(), BSDNames[I].size());
+
+    if (OK) {
+      uint64_t Done = 0;
+
+      if (Members[I].SourceFD != -1)
+        Done = copyFileRange(Members[I].SourceFD, Members[I].SourceOffset, fd,
+                             Data.size());
+
+      OK = writeAll(fd, Data.data() + Done, Data.size() - Done);
+
+      if (Members[I].SourceFD != -1)
+        addCopiedBytes(Data.size() - Done);
+    }
+
+    if (OK && ((Data.size() + BSDNames[I].size()) & 1))
+      OK = writeAll(fd, &Pad, 1);
+  }
+
+  if (close(fd))
+    OK = false;
+
+  if (!OK || sys::fs::rename(TmpPath.c_str(), Path)) {
+    errmsg(Path << ": cannot write archive");
+    sys::fs::remove(TmpPath.c_str());
+    return false;
+  }
+
+  return true;
+}
@@ -20,18 +20,348 @@
   THE SOFTWARE.
  */
 
+#include <cerrno>
+#include <cstdint>
+
+#include <llvm/Support/Path.h>
+#include <llvm/Support/Threading.h>
+
 #include "bc2obj.h"
+#include "threadpool.h"
 
 // Misc
 
+std::mutex OutputLock;
+
 const char *getFileName(const char *Path) {
   const char *FileName = std::strrchr(Path, PATH_DIV);
   return FileName ? FileName + 1 : Path;
 }
 
+void *allocSharedMemory(size_t Size) {
+#ifndef _WIN32
+  // Memory that stays shared with forked children, so that
+  // they can report back more than just an exit code.
+  void *Mem = mmap(nullptr, Size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+  if (Mem == MAP_FAILED) {
+    std::cerr << "mmap() failed" << std::endl;
+    std::abort();
+  }
+
+  return Mem;
+#else
+  return std::calloc(1, Size);
+#endif
+}
+
+bool readAll(int fd, void *Data, size_t Length) {
+  char *Ptr = static_cast<char *>(Data);
+
+  while (Length > 0) {
+    ssize_t Read = read(fd, Ptr, Length);
+
+    if (Read < 0 && errno == EINTR)
+      continue;
+
+    if (Read <= 0)
+      return false;
+
+    Ptr += Read;
+    Length -= Read;
+  }
+
+  return true;
+}
+
+bool writeAll(int fd, const void *Data, size_t Length) {
+  const char *Ptr = static_cast<const char *>(Data);
+
+  while (Length > 0) {
+    ssize_t Written = write(fd, Ptr, Length);
+
+    if (Written < 0 && errno == EINTR)
+      continue;
+
+    if (Written <= 0)
+      return false;
+
+    Ptr += Written;
+    Length -= Written;
+  }
+
+  return true;
+}
+
+bool writeFile(const std::string &Path, const void *Data, size_t Length) {
+  int fd;
+  if (sys::fs::openFileForWrite(Path, fd, sys::fs::F_RW)) {
+    errmsg(Path << ": cannot open file for writing");
+    return false;
+  }
+
+  bool OK = write(fd, Data, Length) == (ssize_t)Length;
+
+  close(fd);
+  return OK;
+}
+
 // Jobs
 
 int ActiveJobs;
+LLVM_THREAD_LOCAL unsigned JobSlots = 1;
+
+namespace {
+ThreadPool *Pool;
+unsigned long NextJobID;
+std::map<unsigned long, std::function<bool(bool OK)>> JobCallbacks;
+
+unsigned JobTokens; // jobserver tokens, one slot runs on our implicit one
+unsigned UsedSlots; // by the active jobs, -split-codegen jobs take more
+std::map<unsigned long, unsigned> JobSlotMap;
+
+// Memory admission (-max-memory). A job is estimated to need a fixed
+// overhead plus MemoryFactor bytes per byte of bitcode. The factor is
+// refined with the peak RSS of every reaped child; threads can't be
+// measured on their own.
+
+const uint64_t JobOverhead = 64 << 20;
+
+struct JobMemory {
+  uint64_t InputSize;
+  uint64_t Estimate;
+  uint64_t BaseRSS; // of the parent when the child was forked
+};
+
+uint64_t MemoryBudget; // 0 if unlimited
+uint64_t CommittedMemory;
+double MemoryFactor = 16;
+std::map<unsigned long, JobMemory> JobMemoryMap;
+std::map<unsigned long, int> JobNodes; // -numa
+
+bool parseMemorySize(StringRef Str, uint64_t &Size) {
+  unsigned Shift = 20;
+
+  if (!Str.empty()) {
+    switch (toupper(Str.back())) {
+    case 'K': Shift = 10; break;
+    case 'M': Shift = 20; break;
+    case 'G': Shift = 30; break;
+    case 'T': Shift = 40; break;
+    default: Shift = 0;
+    }
+
+    if (Shift)
+      Str = Str.drop_back();
+    else
+      Shift = 20;
+  }
+
+  if (Str.getAsInteger(10, Size) || !Size || Size > (SIZE_MAX >> Shift))
+    return false;
+
+  Size <<= Shift;
+  return true;
+}
+
+uint64_t getCurrentRSS() {
+#ifdef __linux__
+  unsigned long Pages, Resident;
+  FILE *Statm = fopen("/proc/self/statm", "r");
+
+  if (Statm) {
+    bool OK = fscanf(Statm, "%lu %lu", &Pages, &Resident) == 2;
+    fclose(Statm);
+
+    if (OK)
+      return static_cast<uint64_t>(Resident) * sysconf(_SC_PAGESIZE);
+  }
+#endif
+#ifndef _WIN32
+  struct rusage Usage;
+
+  if (!getrusage(RUSAGE_SELF, &Usage))
+#ifdef __APPLE__
+    return Usage.ru_maxrss;
+#else
+    return static_cast<uint64_t>(Usage.ru_maxrss) * 1024;
+#endif
+#endif
+  return 0;
+}
+
+uint64_t estimateJobMemory(uint64_t InputSize) {
+  return JobOverhead + static_cast<uint64_t>(MemoryFactor * InputSize);
+}
+
+void releaseJobMemory(unsigned long ID, uint64_t MaxRSS) {
+  auto I = JobMemoryMap.find(ID);
+
+  if (I == JobMemoryMap.end())
+    return;
+
+  const JobMemory &Mem = I->second;
+  CommittedMemory -= Mem.Estimate;
+
+  // Small modules say more about the overhead than about the factor.
+  if (MaxRSS > Mem.BaseRSS + JobOverhead && Mem.InputSize >= (1 << 20)) {
+    double Ratio =
+        static_cast<double>(MaxRSS - Mem.BaseRSS - JobOverhead) /
+        Mem.InputSize;
+
+    // Go up right away, come down slowly.
+    MemoryFactor = std::max(Ratio, (MemoryFactor * 7 + Ratio) / 8);
+  }
+
+  JobMemoryMap.erase(I);
+}
+
+bool exceedsMemoryBudget(uint64_t Memory) {
+  return MemoryBudget && ActiveJobs > 0 &&
+         CommittedMemory + Memory > MemoryBudget;
+}
+
+// Returns 0 if nothing has finished and Block is false.
+
+int waitForAnyJob(bool Block = true) {
+  unsigned long ID;
+  uint64_t MaxRSS = 0;
+  int Status;
+
+  if (Pool) {
+    bool OK;
+
+    if (Block)
+      OK = Pool->wait(ID);
+    else if (!Pool->tryWait(ID, OK))
+      return 0;
+
+    Status = OK ? 1 : -2;
+  } else if (Engine == PREFORK_ENGINE) {
+    bool OK;
+
+    if (!waitForWorker(ID, OK, Block))
+      return 0;
+
+    Status = OK ? 1 : -2;
+  } else {
+    pid_t pid = -1;
+    Status = waitForChild(-1, &pid, Block, &MaxRSS);
+
+    if (!Status)
+      return 0;
+
+    ID = pid;
+  }
+
+  releaseJobMemory(ID, MaxRSS);
+
+  auto Slots = JobSlotMap.find(ID);
+
+  if (Slots != JobSlotMap.end()) {
+    UsedSlots -= Slots->second;
+    JobSlotMap.erase(Slots);
+  }
+
+  auto Node = JobNodes.find(ID);
+
+  if (Node != JobNodes.end()) {
+    releaseNode(Node->second);
+    JobNodes.erase(Node);
+  }
+
+  auto Callback = JobCallbacks.find(ID);
+
+  if (Callback != JobCallbacks.end()) {
+    if (!Callback->second(Status > 0) && Status > 0)
+      Status = -2;
+    JobCallbacks.erase(Callback);
+  }
+
+  return Status;
+}
+
+// Waits until a job of the estimated size is admitted.
+
+bool admitJob(JobMemory &Mem, unsigned &Slots) {
+  if (MemoryBudget)
+    Mem.Estimate = estimateJobMemory(Mem.InputSize);
+
+  if (!waitForJob(Mem.Estimate, &Slots))
+    return false;
+
+  CommittedMemory += Mem.Estimate;
+  return true;
+}
+
+void trackJob(unsigned long ID, std::function<bool(bool OK)> Done,
+              const JobMemory &Mem, unsigned Slots) {
+  if (Done)
+    JobCallbacks[ID] = std::move(Done);
+
+  if (MemoryBudget)
+    JobMemoryMap[ID] = Mem;
+
+  JobSlotMap[ID] = Slots;
+  UsedSlots += Slots;
+  ActiveJobs++;
+}
+
+void releaseJobTokens() {
+  while (JobTokens > 0 && JobTokens >= UsedSlots) {
+    releaseJobToken();
+    JobTokens--;
+  }
+}
+} // end unnamed namespace
+
+bool initJobs() {
+  if (!MaxMemory.empty()) {
+    if (!parseMemorySize(MaxMemory, MemoryBudget)) {
+      errmsg("invalid memory size: " << MaxMemory);
+      return false;
+    }
+
+    errmsg("limiting jobs to " << (MemoryBudget >> 20) << " MiB of memory");
+  } else if (uint64_t Limit = getMemoryLimit()) {
+    // The cgroup would kill us instead of letting jobs wait. Leave room
+    // for the parent and for what the estimates miss.
+    uint64_t Reserved = getCurrentRSS() + Limit / 8;
+
+    if (Limit > Reserved + JobOverhead) {
+      MemoryBudget = Limit - Reserved;
+      errmsg("limiting jobs to " << (MemoryBudget >> 20)
+             << " MiB of memory (cgroup limit)");
+    }
+  }
+
+  if (initJobServer())
+    ONUNIX(errmsg("using the make jobserver (at most " << NumJobs << " job"
+                  << (NumJobs != 1 ? "s" : "") << ")"));
+
+  if (Engine != THREAD_ENGINE)
+    return true;
+
+#if LLVM_VERSION_GE(3, 6)
+  if (!llvm_is_multithreaded()) {
+    errmsg("'-engine=thread' requires a multithreaded LLVM build");
+    return false;
+  }
+
+  Pool = new ThreadPool(NumJobs);
+  return true;
+#else
+  errmsg("'-engine=thread' requires LLVM 3.6 or later");
+  return false;
+#endif
+}
+
+void finishJobs() {
+  finishWorkers();
+  delete Pool;
+  Pool = nullptr;
+}
 
 pid_t forkProcess(bool wait, bool *OK) {
 #ifndef _WIN32
@@ -56,15 +386,31 @@ pid_t forkProcess(bool wait, bool *OK) {
 #endif
 }
 
-int waitForChild(const pid_t pid) {
+int waitForChild(const pid_t pid, pid_t *Reaped, bool Block,
+                 uint64_t *MaxRSS) {
 #ifndef _WIN32
   int status;
+  struct rusage Usage;
+  pid_t Child = wait4(pid, &status, Block ? 0 : WNOHANG, &Usage);
 
-  if (waitpid(-1, &status, 0) == -1) {
+  if (!Child)
+    return 0;
+
+  if (Child == -1) {
     std::cerr << "waitpid() failed" << std::endl;
     std::abort();
   }
 
+  if (Reaped)
+    *Reaped = Child;
+
+  if (MaxRSS)
+#ifdef __APPLE__
+    *MaxRSS = Usage.ru_maxrss;
+#else
+    *MaxRSS = static_cast<uint64_t>(Usage.ru_maxrss) * 1024;
+#endif
+
   if (WIFSIGNALED(status)) {
     std::cerr << "uncaught signal: " << strsignal(WTERMSIG(status))
               << std::endl;
@@ -81,49 +427,173 @@ int waitForChild(const pid_t pid) {
   return 1;
 }
 
-bool waitForJob() {
+bool waitForJob(uint64_t Memory, unsigned *Slots) {
+  unsigned Wanted = Slots ? std::max(1u, std::min(*Slots, (unsigned)NumJobs))
+                          : 1;
   bool OK = true;
-  if (ActiveJobs >= NumJobs) {
-    OK = waitForChild(-1) > 0;
+
+  if (Slots)
+    *Slots = Wanted;
+
+  // A job that doesn't fit into the memory budget has to wait for the
+  // others, even if there are free job slots.
+  while ((ActiveJobs > 0 && UsedSlots + Wanted > (unsigned)NumJobs) ||
+         exceedsMemoryBudget(Memory)) {
+    if (waitForAnyJob() <= 0)
+      OK = false;
     ActiveJobs--;
   }
+
+  if (!isJobServerActive())
+    return OK;
+
+  // Every slot but the first one needs a token. Keep reaping our own jobs
+  // while waiting, their tokens can be reused right away.
+  while (JobTokens < UsedSlots && isJobServerActive()) {
+    if (acquireJobToken(10)) {
+      JobTokens++;
+      break;
+    }
+
+    if (int Status = waitForAnyJob(false)) {
+      if (Status < 0)
+        OK = false;
+      ActiveJobs--;
+    }
+  }
+
+  // The extra slots of a job only take the tokens that are free right
+  // now. Waiting for them could wait forever under a smaller 'make -j'.
+  if (Slots) {
+    *Slots = 1;
+
+    while (*Slots < Wanted &&
+           (!isJobServerActive() || acquireJobToken(0))) {
+      if (isJobServerActive())
+        JobTokens++;
+      ++*Slots;
+    }
+  }
+
   return OK;
 }
 
 bool waitForJobs() {
   bool OK = true;
   while (ActiveJobs > 0) {
-    if (waitForChild(-1) <= 0)
+    if (waitForAnyJob() <= 0)
       OK = false;
     ActiveJobs--;
+    releaseJobTokens();
   }
   ActiveJobs = 0;
+  UsedSlots = 0;
+  releaseJobTokens();
+  return OK;
+}
+
+// Runs Job on the selected engine. Done is called in the parent once
+// the job has been reaped, its result replaces the job's result.
+// InputSize is used to estimate the memory the job needs.
+
+bool runJob(std::function<bool()> Job, std::function<bool(bool OK)> Done,
+            uint64_t InputSize, unsigned Slots) {
+  JobMemory Mem = {InputSize, 0, 0};
+
+  if (!admitJob(Mem, Slots))
+    return false;
+
+  int Node = acquireNode();
+
+  if (Pool) {
+    unsigned long ID = NextJobID++;
+
+    trackJob(ID, std::move(Done), Mem, Slots);
+
+    if (Node >= 0)
+      JobNodes[ID] = Node;
+
+    Pool->async([Job, Node, Slots] {
+      bindToNode(Node);
+      JobSlots = Slots;
+      return Job();
+    }, ID);
+
+    return true;
+  }
+
+  bool OK = true;
+
+  if (MemoryBudget)
+    Mem.BaseRSS = getCurrentRSS();
+
+  pid_t pid = forkProcess(false);
+
+  if (!pid) {
+    bindToNode(Node);
+    JobSlots = Slots;
+    OK = Job();
+    childExit(!OK);
+#ifdef _WIN32
+    return Done ? Done(OK) : OK;
+#endif
+  }
+
+  trackJob(pid, std::move(Done), Mem, Slots);
+
+  if (Node >= 0)
+    JobNodes[pid] = Node;
+
   return OK;
 }
 
+bool runJob(const WorkerJob &Job, std::function<bool(bool OK)> Done,
+            uint64_t InputSize, unsigned Slots) {
+  // Workers are measured as threads are: not at all.
+  JobMemory Mem = {InputSize, 0, 0};
+
+  if (!admitJob(Mem, Slots))
+    return false;
+
+  unsigned long ID = NextJobID++;
+  WorkerJob SlottedJob = Job;
+  SlottedJob.Slots = Slots;
+
+  if (!submitWorkerJob(SlottedJob, ID)) {
+    CommittedMemory -= Mem.Estimate;
+    releaseJobTokens();
+    return false;
+  }
+
+  trackJob(ID, std::move(Done), Mem, Slots);
+  return true;
+}
+
 // BitCodeArchive -> Public
 
 BitCodeArchive::BitCodeArchive(const std::string &Path, bool &OK)
-    : Buf(MemoryBuffer::getFile(Path.c_str(), -1, false)) {
+    : Buf(MemoryBuffer::getFile(Path.c_str(), -1, false)), Archive(nullptr),
+      FD(-1) {
   if (Buf.getError()) {
     std::cerr << Path << ": cannot open archive" << std::endl;
     OK = false;
     return;
   }
 
-  std::error_code EC;
-  Archive = new object::Archive(getMemBuffer(Buf.get()), EC);
+  if (classifyInput(Buf.get()->getBuffer()) == INPUT_THIN_ARCHIVE)
+    OK = readThinArchive(Path);
+  else
+    OK = readArchive(Path);
+}
 
-  if (EC) {
-    std::cerr << Path << ": invalid archive" << std::endl;
-    OK = false;
-    return;
-  }
+BitCodeArchive::~BitCodeArchive() {
+  delete Archive;
 
-  OK = true;
+  if (FD != -1)
+    close(FD);
 }
 
-BitCodeArchive::~BitCodeArchive() { delete Archive; }
+// BitCodeArchive -> Private
 
 std::string
 BitCodeArchive::getObjName(const llvm::object::Archive::child_iterator &child) {
@@ -136,39 +606,159 @@ BitCodeArchive::getObjName(const llvm::object::Archive::child_iterator &child) {
   return std::string(ObjName.data(), ObjName.size());
 }
 
-// BitCodeModule -> Public
+bool BitCodeArchive::readArchive(const std::string &Path) {
+  // For streaming native members straight into the output archive.
+  if (sys::fs::openFileForRead(Path, FD))
+    FD = -1;
 
-BitCodeModule::BitCodeModule(const std::string &Path, bool &OK)
-    : isNativeObjectFile(false) {
-  std::string errMsg;
-  Module = LTOModule::createFromFile(Path.c_str(), TargetOpts, errMsg);
-  check(errMsg, Path, OK);
-  setTriple(OK);
+  std::error_code EC;
+  Archive = new object::Archive(getMemBuffer(Buf.get()), EC);
+
+  if (EC) {
+    std::cerr << Path << ": invalid archive" << std::endl;
+    return false;
+  }
+
+  const char *Start = Archive->getData().data();
+
+  for (auto Obj = Archive->child_begin(); Obj != Archive->child_end(); ++Obj) {
+    auto Data = Obj->getBuffer();
+
+#if LLVM_VERSION_GE(3, 7)
+    if (Data.getError()) {
+      std::cerr << Path << ": invalid archive member" << std::endl;
+      return false;
+    }
+
+    llvm::StringRef StrBuf = *Data;
+#else
+    llvm::StringRef StrBuf = Data;
+#endif
+
+    Members.push_back({getObjName(Obj), StrBuf, FD,
+                       static_cast<uint64_t>(StrBuf.data() - Start), Path});
+  }
+
+  return true;
 }
 
-BitCodeModule::BitCodeModule(const std::string &Path, StringRef Data, bool &OK)
-    : isNativeObjectFile(false) {
+// GNU thin archives only store the symbol and the name table, members
+// are referenced by their path (relative to the archive). They are
+// mapped from there, nothing gets copied.
+
+bool BitCodeArchive::readThinArchive(const std::string &Path) {
+  StringRef Data = Buf.get()->getBuffer();
+  StringRef Dir = sys::path::parent_path(Path);
+  StringRef Names;
+  size_t Pos = 8; // "!<thin>\n"
+
+  while (Pos + 60 <= Data.size()) {
+    StringRef Header = Data.substr(Pos, 60);
+    StringRef Name = Header.substr(0, 16).rtrim(' ');
+    uint64_t Size;
+
+    if (Header.substr(48, 10).rtrim(' ').getAsInteger(10, Size)) {
+      std::cerr << Path << ": invalid archive" << std::endl;
+      return false;
+    }
+
+    Pos += 60;
+
+    // The only members that are stored in the archive.
+    if (Name == "/" || Name == "/SYM64/" || Name == "//") {
+      if (Name == "//")
+        Names = Data.substr(Pos, Size);
+      Pos += Size + (Size & 1);
+      continue;
+    }
+
+    StringRef MemberPath;
+    size_t Offset;
+
+    if (!Name.startswith("/")) {
+      MemberPath = Name.rtrim('/');
+    } else if (!Name.substr(1).getAsInteger(10, Offset) &&
+               Offset < Names.size()) {
+      MemberPath = Names.substr(Offset);
+      MemberPath = MemberPath.substr(0, MemberPath.find("/\n"));
+    } else {
+      std::cerr << Path << ": invalid archive member name" << std::endl;
+      return false;
+    }
+
+    SmallString<128> FullPath;
+
+    if (!sys::path::is_absolute(MemberPath))
+      FullPath = Dir;
+
+    sys::path::append(FullPath, MemberPath);
+
+    auto MemberBuf = MemoryBuffer::getFile(FullPath.c_str(), -1, false);
+
+    if (MemberBuf.getError()) {
+      std::cerr << FullPath.c_str() << ": cannot open archive member"
+                << std::endl;
+      return false;
+    }
+
+    MemberBufs.push_back(moveMemBuffer(MemberBuf.get()));
+    Members.push_back({sys::path::filename(MemberPath).str(),
+                       MemberBufs.back()->getBuffer(), -1, 0,
+                       FullPath.c_str()});
+  }
+
+  return true;
+}
+
+// BitCodeModule -> Public
+
+BitCodeModule::BitCodeModule(const std::string &Path)
+    : Path(Path), Module(nullptr) {}
+
+BitCodeModule::~BitCodeModule() { delete Module; }
+
+bool BitCodeModule::parse(StringRef Data, LLVMContext *Context) {
+  bool OK;
   std::string errMsg;
-  Module =
-      LTOModule::createFromBuffer(Data.data(), Data.size(), TargetOpts, errMsg);
+
+#if LLVM_VERSION_GE(3, 6)
+  std::unique_ptr<MemoryBuffer> FileBuf;
+
+  if (!Data.data()) {
+    auto Buf = MemoryBuffer::getFile(Path.c_str(), -1, false);
+
+    if (Buf.getError()) {
+      std::cerr << Path << ": cannot open file" << std::endl;
+      return false;
+    }
+
+    FileBuf = moveMemBuffer(Buf.get());
+    Data = FileBuf->getBuffer();
+  }
+
+  Module = LTOModule::createInContext(Data.data(), Data.size(), TargetOpts,
+                                      errMsg, Path, Context);
+#else
+  (void)Context;
+
+  if (Data.data())
+    Module = LTOModule::createFromBuffer(Data.data(), Data.size(), TargetOpts,
+                                         errMsg);
+  else
+    Module = LTOModule::createFromFile(Path.c_str(), TargetOpts, errMsg);
+#endif
+
   check(errMsg, Path, OK);
   setTriple(OK);
+  return OK;
 }
 
-BitCodeModule::~BitCodeModule() { delete Module; }
-
 // BitCodeModule -> Private
 
 void BitCodeModule::check(const std::string &errMsg, const std::string &Path,
                           bool &OK) {
-  if (!(OK = !!Module)) {
-    if (errMsg == "Bitcode section not found in object file") {
-      isNativeObjectFile = true;
-      return;
-    }
-
+  if (!(OK = !!Module))
     std::cerr << Path << ": " << errMsg << std::endl;
-  }
 }
 
 void BitCodeModule::setTriple(bool &OK) {
@@ -187,93 +777,123 @@ void BitCodeModule::setTriple(bool &OK) {
 
 // NativeCodeGenerator -> Public
 
-NativeCodeGenerator::NativeCodeGenerator(const std::string &Path, bool &OK,
-                                         bool &isNativeObjectFile)
-    : Path(Path), BCModule(Path, OK) {
-  setOutPutPath();
-  isNativeObjectFile = BCModule.isNativeObjectFile;
-
-  if (isNativeObjectFile)
-    OK = true;
-}
+NativeCodeGenerator::NativeCodeGenerator(const std::string &Path)
+    : NativeCodeGenerator(Path, StringRef()) {}
 
 NativeCodeGenerator::NativeCodeGenerator(const std::string &Path,
-                                         StringRef Data, bool &OK,
-                                         bool &isNativeObjectFile)
-    : Path(Path), BCModule(Path, Data, OK), Data(Data) {
+                                         StringRef Data)
+    : Path(Path),
+#if LLVM_VERSION_GE(3, 6)
+      // Each code generator gets its own context, so that they can be
+      // used from several threads at once.
+      CodeGen(llvm::make_unique<LLVMContext>()),
+#endif
+      BCModule(Path), Data(Data) {
   setOutPutPath();
-  isNativeObjectFile = BCModule.isNativeObjectFile;
-
-  if (isNativeObjectFile)
-    OK = true;
 }
 
 bool NativeCodeGenerator::generateNativeCode() {
-  if (BCModule.isNativeObjectFile) {
-    if (sys::fs::copy_file(Path, OutPath)) {
-      std::cerr << "cannot copy " << Path << " to " << OutPath << std::endl;
+  // The cache, the lazy loader and the variants need the input bytes.
+  if ((isObjectCacheEnabled() || LowMemory || !getVariants().empty()) &&
+      !Data.data()) {
+    auto Buf = MemoryBuffer::getFile(Path.c_str(), -1, false);
+
+    if (Buf.getError()) {
+      errmsg(Path << ": cannot open file");
       return false;
     }
-    return true;
-  }
 
-  std::string errMsg;
-  const char *name;
+    FileBuf = moveMemBuffer(Buf.get());
+    Data = FileBuf->getBuffer();
+  }
 
-  if (!setupCodeGenOpts())
+  if (!generateNativeCodeMemory())
     return false;
 
-  if (!CodeGen.compile_to_file(&name, DisableOptimizations, DisableInlinePass,
-                               DisableGVNPass, DisableVectorizationPass,
-                               errMsg)) {
-    errmsg(Path << ":" << errMsg);
-    return false;
-  }
+  PhaseTimer Timer(Stats, PHASE_WRITE);
 
-  if (sys::fs::rename(name, OutPath)) {
-    if (errno != EXDEV || sys::fs::copy_file(name, OutPath) ||
-      sys::fs::remove(name)) {
-      errmsg("cannot rename " << name << " to " << OutPath);
-      return false;
-    }
+  if (!VariantCodes.empty()) {
+    for (size_t I = 0; I < VariantCodes.size(); ++I)
+      if (!writeCodeToFile(getVariantPath(OutPath, I), I))
+        return false;
+
+    return true;
   }
 
-  return true;
+  // A native object file that hasn't been read into memory.
+  if (!code.Code)
+    return passthroughFile(Path, OutPath);
+
+  return writeCodeToFile(OutPath);
 }
 
 bool NativeCodeGenerator::generateNativeCodeMemory() {
-  if (BCModule.isNativeObjectFile) {
+  InputKind Kind = Data.data() ? classifyInput(Data) : classifyFile(Path);
+
+  // Native objects are handed back as they are.
+  if (Kind == INPUT_NATIVE_OBJECT) {
     code.Code = Data.data();
     code.Length = Data.size();
+
+    if (!Variant)
+      VariantCodes.resize(getVariants().size());
+
+    for (auto &VariantCode : VariantCodes) {
+      VariantCode.Code = code.Code;
+      VariantCode.Length = code.Length;
+    }
+
     return true;
   }
 
-  std::string errMsg;
+  std::string CacheKey;
+
+  // The variants of a module are cached by the generators of those
+  // that aren't generated from the shared optimized module.
+  if (isObjectCacheEnabled() && !Partition &&
+      (Variant || getVariants().empty())) {
+    CacheKey = getObjectCacheKey(Data, Opts);
+
+    if (lookupObjectCache(CacheKey, code.CodeBuf)) {
+      code.Code = code.CodeBuf->getBufferStart();
+      code.Length = code.CodeBuf->getBufferSize();
+
+      if (Stats) {
+        Stats->CacheHit = true;
+        Stats->OutputSize = code.Length;
+      }
 
-  if (!setupCodeGenOpts())
+      return true;
+    }
+  }
+
+  if (!(LowMemory ? parseModuleLazily() : parseModule()))
     return false;
 
-  auto CodeBuf =
-      CodeGen.compile(&code.Length, DisableOptimizations, DisableInlinePass,
-                      DisableGVNPass, DisableVectorizationPass, errMsg);
+  std::string errMsg;
 
-#if LLVM_VERSION_GE(3, 7)
-  if (auto *MemBuffer = CodeBuf.get()) {
-    code.CodeBuf = std::move(CodeBuf);
-    code.Code = MemBuffer->getBufferStart();
-    code.Length = MemBuffer->getBufferSize();
-  } else {
-    code.Code = nullptr;
+  {
+    PhaseTimer Timer(Stats, PHASE_SETUP);
+
+    if (!(LowMemory ? setupTargetMachine() : setupCodeGenOpts()))
+      return false;
   }
-#else
-  code.Code = CodeBuf;
-#endif
 
-  if (!code.Code) {
+  if (!(LowMemory ? compileModuleLazily(errMsg) : compileModule(errMsg))) {
     errmsg(Path << ":" << errMsg);
     return false;
   }
 
+  if (Stats) {
+    Stats->OutputSize = code.Length;
+
+    for (auto &VariantCode : VariantCodes)
+      Stats->OutputSize += VariantCode.Length;
+  }
+
+  if (!CacheKey.empty())
+    storeObjectCache(CacheKey, code.Code, code.Length);
+
   return true;
 }
 
@@ -284,20 +904,118 @@ bool NativeCodeGenerator::writeCodeToDisk(const std::string &Dir) {
   Path += PATH_DIV;
   Path += getObjFileName();
 
-  int fd;
-  if (sys::fs::openFileForWrite(Path, fd, sys::fs::F_RW)) {
-    errmsg(Path << ": cannot open file for writing");
-    return false;
-  }
+  return writeCodeToFile(Path);
+}
 
-  bool OK = write(fd, code.Code, code.Length) == (ssize_t)code.Length;
+bool NativeCodeGenerator::writeCodeToFile(const std::string &Path) {
+  return writeFile(Path, code.Code, code.Length);
+}
 
-  close(fd);
-  return OK;
+bool NativeCodeGenerator::writeCodeToFile(const std::string &Path,
+                                          size_t Index) {
+  auto &VariantCode = VariantCodes[Index];
+  return writeFile(Path, VariantCode.Code, VariantCode.Length);
+}
+
+bool NativeCodeGenerator::writeCodeToFD(int FD) {
+  return writeObjectFD(FD, code.Code, code.Length);
+}
+
+bool NativeCodeGenerator::writeCodeToFD(int FD, size_t Index) {
+  auto &VariantCode = VariantCodes[Index];
+  return writeObjectFD(FD, VariantCode.Code, VariantCode.Length);
+}
+
+NativeCodeGenerator::Code NativeCodeGenerator::takeCode() {
+#if LLVM_VERSION_LT(3, 7)
+  // The object buffer is owned by CodeGen, copy it out.
+  if (code.Code && code.Code != Data.data() && !code.CodeBuf) {
+    StringRef Obj(static_cast<const char *>(code.Code), code.Length);
+#if LLVM_VERSION_GE(3, 6)
+    code.CodeBuf = MemoryBuffer::getMemBufferCopy(Obj);
+#else
+    code.CodeBuf.reset(MemoryBuffer::getMemBufferCopy(Obj));
+#endif
+    code.Code = code.CodeBuf->getBufferStart();
+  }
+#endif
+  return std::move(code);
+}
+
+NativeCodeGenerator::Code NativeCodeGenerator::takeCode(size_t Index) {
+  return std::move(VariantCodes[Index]);
 }
 
 // NativeCodeGenerator -> Private
 
+bool NativeCodeGenerator::parseModule() {
+  PhaseTimer Timer(Stats, PHASE_PARSE);
+  return BCModule.parse(Data, getContext());
+}
+
+bool NativeCodeGenerator::compileModule(std::string &errMsg) {
+#if LLVM_VERSION_GE(3, 7)
+  // compileOptimized() goes straight to the target's object emitter.
+  if (!CodeGenOnly && !Partition) {
+    PhaseTimer Timer(Stats, PHASE_OPTIMIZE);
+
+    if (!CodeGen.optimize(false, DisableInlinePass, DisableGVNPass,
+                          DisableVectorizationPass, errMsg))
+      return false;
+  }
+
+  PhaseTimer Timer(Stats, PHASE_CODEGEN);
+
+  if (!getVariants().empty() && !Variant && !Partition) {
+    std::vector<std::unique_ptr<MemoryBuffer>> Objects;
+
+    if (!compileVariants(CodeGen, Path, Data, BCModule.TripleStr, Opts,
+                         Objects, errMsg))
+      return false;
+
+    VariantCodes.resize(Objects.size());
+
+    for (size_t I = 0; I < Objects.size(); ++I) {
+      VariantCodes[I].Code = Objects[I]->getBufferStart();
+      VariantCodes[I].Length = Objects[I]->getBufferSize();
+      VariantCodes[I].CodeBuf = std::move(Objects[I]);
+    }
+
+    return true;
+  }
+
+  if (SplitCodeGen > 1 && !Partition) {
+    if (!splitCodeGen(CodeGen, Path, BCModule.TripleStr, Opts, code.CodeBuf,
+                      errMsg))
+      return false;
+  } else {
+    code.CodeBuf = CodeGen.compileOptimized(errMsg);
+  }
+
+  if (!code.CodeBuf)
+    return false;
+
+  code.Code = code.CodeBuf->getBufferStart();
+  code.Length = code.CodeBuf->getBufferSize();
+#else
+  PhaseTimer Timer(Stats, PHASE_CODEGEN);
+  code.Code =
+      CodeGen.compile(&code.Length, DisableOptimizations || CodeGenOnly,
+                      DisableInlinePass, DisableGVNPass,
+                      DisableVectorizationPass, errMsg);
+#endif
+
+  return !!code.Code;
+}
+
+LLVMContext *NativeCodeGenerator::getContext() {
+#if LLVM_VERSION_GE(3, 6)
+  return &CodeGen.getContext();
+#else
+  return nullptr;
+#endif
+}
+
 const char *NativeCodeGenerator::getDefaultTargetCPU() const {
   const auto &Triple = BCModule.Triple;
 
@@ -338,15 +1056,54 @@ const char *NativeCodeGenerator::getDefaultTargetCPU() const {
   return "";
 }
 
+void NativeCodeGenerator::parseLLVMOpts() {
+  if (LLVMOpts.empty())
+    return;
+
+  // These end up in global state, only parse them once per process.
+  static std::once_flag LLVMOptsParsed;
+
+  std::call_once(LLVMOptsParsed, [this] {
+    for (auto LLVMOpt : LLVMOpts)
+      CodeGen.setCodeGenDebugOptions(LLVMOpt.c_str());
+    CodeGen.parseCodeGenDebugOptions();
+  });
+}
+
+// Returns false if '-pic' and '-pie' don't apply to the target.
+
+bool NativeCodeGenerator::usePICOpts() const {
+  bool isOSWindows = (Opts.PIC || Opts.PIE) && BCModule.Triple.isOSWindows();
+
+  if (Opts.PIC && isOSWindows) {
+    errmsg("warning: " << Path << ": '-pic' has no effect for target "
+                       << BCModule.TripleStr << '\'');
+    return false;
+  } else if (Opts.PIE && isOSWindows) {
+    errmsg("warning: " << Path << ": '-pie' has no effect for target '"
+                       << BCModule.TripleStr << '\'');
+    return false;
+  }
+
+  return true;
+}
+
 bool NativeCodeGenerator::setupCodeGenOpts() {
-  if (!::Target.empty()) {
+  if (!Opts.Target.empty()) {
     bool OK = true;
-    BCModule.Module->setTargetTriple(::Target.c_str());
+    BCModule.Module->setTargetTriple(Opts.Target.c_str());
     BCModule.setTriple(OK);
     if (!OK)
       return false;
   }
 
+#if LLVM_VERSION_GE(3, 7)
+  // Partitions and variants come from an already annotated module.
+  if (!Profile.empty() && !Partition &&
+      !applyProfile(BCModule.Module->getModule(), Path))
+    return false;
+#endif
+
   std::string errMsg;
 
   if (!CodeGen.addModule(BCModule.Module, errMsg)) {
@@ -362,47 +1119,47 @@ bool NativeCodeGenerator::setupCodeGenOpts() {
     case LTO_SYMBOL_DEFINITION_REGULAR:
     case LTO_SYMBOL_DEFINITION_TENTATIVE:
     case LTO_SYMBOL_DEFINITION_WEAK:
+      // Everything that isn't exported gets internalized (-exports).
+      if (!isExported(BCModule.Module->getSymbolName(I)))
+        break;
+
       CodeGen.addMustPreserveSymbol(BCModule.Module->getSymbolName(I));
-    }
-  }
 
-  if (!LLVMOpts.empty()) {
-    for (auto LLVMOpt : LLVMOpts)
-      CodeGen.setCodeGenDebugOptions(LLVMOpt.c_str());
-    CodeGen.parseCodeGenDebugOptions();
+      // For the archive symbol table.
+      if ((SymAttr & LTO_SYMBOL_SCOPE_MASK) != LTO_SYMBOL_SCOPE_INTERNAL)
+        code.Symbols.push_back(BCModule.Module->getSymbolName(I));
+    }
   }
 
-  bool isOSWindows = (PIC || PIE) && BCModule.Triple.isOSWindows();
+  parseLLVMOpts();
 
-  if (PIC && isOSWindows) {
-    errmsg("warning: " << Path << ": '-pic' has no effect for target "
-                       << BCModule.TripleStr << '\'');
-  } else if (PIE && isOSWindows) {
-    errmsg("warning: " << Path << ": '-pie' has no effect for target '"
-                       << BCModule.TripleStr << '\'');
-  } else {
-    if (PIC)
+  if (usePICOpts()) {
+    if (Opts.PIC)
       CodeGen.setCodePICModel(LTO_CODEGEN_PIC_MODEL_DYNAMIC);
-    if (PIE)
+    if (Opts.PIE)
       CodeGen.setCodePICModel(LTO_CODEGEN_PIC_MODEL_STATIC);
   }
 
+  std::string CPU = Opts.CPU;
+
   if (CPU.empty())
     CPU = getDefaultTargetCPU();
 
   if (!CPU.empty())
     CodeGen.setCpu(CPU.c_str());
 
-  if (!Attrs.empty())
-    CodeGen.setAttr(Attrs.c_str());
+  noteTarget(BCModule.TripleStr, CPU, Opts.Attrs);
+
+  if (!Opts.Attrs.empty())
+    CodeGen.setAttr(Opts.Attrs.c_str());
 
 #if LLVM_VERSION_GE(3, 7)
-  if (OptLevel != 2)
-    CodeGen.setOptLevel(OptLevel);
+  if (Opts.OptLevel != 2)
+    CodeGen.setOptLevel(Opts.OptLevel);
 #endif
 
-  CodeGen.setDebugInfo(GenerateDebugSymbols ? LTO_DEBUG_MODEL_DWARF
-                                            : LTO_DEBUG_MODEL_NONE);
+  CodeGen.setDebugInfo(Opts.GenerateDebugSymbols ? LTO_DEBUG_MODEL_DWARF
+                                                 : LTO_DEBUG_MODEL_NONE);
 
   return true;
 }
@@ -24,29 +24,45 @@
 #include <string>
 #include <vector>
 #include <queue>
+#include <map>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <unistd.h>
 #include <sys/types.h>
 
 #ifndef _WIN32
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #endif
 
 #include <llvm/Support/CommandLine.h>
+#include <llvm/Support/Compiler.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/Program.h>
 #include <llvm/LTO/LTOModule.h>
 #include <llvm/LTO/LTOCodeGenerator.h>
 #include <llvm/Support/FileUtilities.h>
 #include <llvm/Object/Archive.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Target/TargetMachine.h>
 
 #include "llvm-compat.h"
 #include "cpucount.h"
+#include "jobserver.h"
+#include "server.h"
 
 using namespace llvm;
 
+enum ExecutionEngine { FORK_ENGINE, THREAD_ENGINE, PREFORK_ENGINE };
+
 extern cl::opt<bool> GenerateDebugSymbols;
 extern cl::opt<bool> DisableOptimizations;
-extern cl::opt<bool> DisableOptimizations;
+extern cl::opt<bool> CodeGenOnly;
+extern cl::opt<bool> LowMemory;
 extern cl::opt<bool> DisableInlinePass;
 extern cl::opt<bool> DisableGVNPass;
 extern cl::opt<bool> DisableVectorizationPass;
@@ -58,19 +74,42 @@ extern cl::opt<bool> PIE;
 extern cl::opt<std::string> CPU;
 extern cl::opt<std::string> Attrs;
 extern cl::list<std::string> BitCodeFiles;
+extern cl::list<std::string> InputLists;
 extern cl::opt<std::string> OutDir;
 extern cl::opt<int> NumJobs;
+extern cl::opt<std::string> MaxMemory;
+extern cl::opt<ExecutionEngine> Engine;
+extern cl::opt<bool> LinkNative;
+extern cl::opt<std::string> TimeReport;
+extern cl::opt<bool> PerfCounters;
+extern cl::opt<bool> NUMA;
+extern cl::opt<unsigned> SplitCodeGen;
+extern cl::list<std::string> VariantSpecs;
+extern cl::opt<std::string> LD;
+extern cl::opt<bool> ThinLTO;
+extern cl::opt<unsigned> ImportLimit;
+extern cl::opt<std::string> CacheDir;
+extern cl::opt<unsigned> CacheSize;
+extern cl::opt<bool> Incremental;
+extern cl::opt<std::string> Profile;
+extern cl::opt<std::string> ExportList;
+extern cl::opt<bool> DeriveExports;
+extern cl::opt<std::string> Server;
 
 // Misc
 
+extern std::mutex OutputLock;
+
 #define errmsg(...)                                                            \
   do {                                                                         \
+    std::lock_guard<std::mutex> OutputLockGuard(OutputLock);                   \
     errs() << __VA_ARGS__ << '\n';                                             \
     errs().flush();                                                            \
   } while (0)
 
 #define msg(...)                                                               \
   do {                                                                         \
+    std::lock_guard<std::mutex> OutputLockGuard(OutputLock);                   \
     outs() << __VA_ARGS__ << '\n';                                             \
     outs().flush();                                                            \
   } while (0)
@@ -87,6 +126,10 @@ extern cl::opt<int> NumJobs;
 #endif
 
 const char *getFileName(const char *Path);
+void *allocSharedMemory(size_t Size);
+bool readAll(int fd, void *Data, size_t Length);
+bool writeAll(int fd, const void *Data, size_t Length);
+bool writeFile(const std::string &Path, const void *Data, size_t Length);
 
 // Jobs
 
@@ -103,40 +146,389 @@ const char *getFileName(const char *Path);
 #endif
 
 extern int ActiveJobs;
+// The slots the running job has been admitted for (see runJob()).
+extern LLVM_THREAD_LOCAL unsigned JobSlots;
+bool initJobs();
+void finishJobs();
 pid_t forkProcess(bool wait = true, bool *OK = nullptr);
-int waitForChild(const pid_t pid);
-bool waitForJob();
+int waitForChild(const pid_t pid, pid_t *Reaped = nullptr, bool Block = true,
+                 uint64_t *MaxRSS = nullptr);
+// Slots is the number of slots the job wants, and gets the number it
+// has been given: at least one, extra jobserver tokens only if they are
+// free right away.
+bool waitForJob(uint64_t Memory = 0, unsigned *Slots = nullptr);
 bool waitForJobs();
+bool runJob(std::function<bool()> Job,
+            std::function<bool(bool OK)> Done = nullptr,
+            uint64_t InputSize = 0, unsigned Slots = 1);
+
+struct WorkerJob;
+bool runJob(const WorkerJob &Job, std::function<bool(bool OK)> Done,
+            uint64_t InputSize = 0, unsigned Slots = 1); // -engine=prefork
+
+// Code Generation Options
+
+// The options that can be set per input (see -inputs). They default to
+// the command line.
+
+struct CodeGenOptions {
+  std::string Target;
+  std::string CPU;
+  std::string Attrs;
+  unsigned OptLevel;
+  bool PIC;
+  bool PIE;
+  bool GenerateDebugSymbols;
+
+  CodeGenOptions();
+  bool parse(StringRef Opt); // i.e. "-cpu=haswell", false if unsupported
+};
+
+// Inputs
+
+struct InputFile {
+  std::string Path;
+  std::string OutPath; // of the object or the archive
+  CodeGenOptions Opts;
+};
+
+// Collects the inputs from the command line and from the input lists,
+// directories are searched recursively.
+bool collectInputs(std::vector<InputFile> &Inputs);
+
+// Object Cache
+
+bool initObjectCache();
+bool isObjectCacheEnabled();
+std::string getObjectCacheKey(StringRef Data, const CodeGenOptions &Opts);
+bool lookupObjectCache(const std::string &Key,
+                       std::unique_ptr<MemoryBuffer> &Buf);
+bool storeObjectCache(const std::string &Key, const void *Code,
+                      size_t Length);
+void finishObjectCache();
+
+// Time Report
+
+enum JobPhase {
+  PHASE_PARSE,
+  PHASE_SETUP,
+  PHASE_OPTIMIZE,
+  PHASE_CODEGEN, // includes optimization before LLVM 3.7
+  PHASE_WRITE,
+  NUM_PHASES
+};
+
+// -perf-counters
+enum PerfCounter {
+  COUNTER_CYCLES,
+  COUNTER_INSTRUCTIONS,
+  COUNTER_CACHE_MISSES,
+  COUNTER_BRANCH_MISSES,
+  COUNTER_PAGE_FAULTS,
+  NUM_COUNTERS
+};
+
+enum CounterSource {
+  COUNTERS_NONE,
+  COUNTERS_PERF_EVENT,
+  COUNTERS_RUSAGE // page faults only
+};
+
+extern const char *CounterNames[NUM_COUNTERS];
+
+void initPerfCounters();
+CounterSource getCounterSource();
+void readPerfCounters(uint64_t *Values); // of the calling thread
+
+struct JobStats {
+  double Wall[NUM_PHASES];
+  double CPU[NUM_PHASES];
+  uint64_t Counters[NUM_PHASES][NUM_COUNTERS];
+  uint64_t PeakRSS;
+  uint64_t OutputSize;
+  bool CacheHit;
+  bool Finished;
+  bool Failed;
+};
+
+struct ReportEntry {
+  std::string Name;
+  uint64_t InputSize;
+  bool Passthrough;
+  bool Reused; // from the previous output archive, with -incremental
+};
+
+class PhaseTimer {
+public:
+  PhaseTimer(JobStats *Stats, JobPhase Phase);
+  ~PhaseTimer();
+
+private:
+  JobStats *Stats;
+  JobPhase Phase;
+  double Wall;
+  double CPU;
+  uint64_t Counters[NUM_COUNTERS];
+};
+
+bool initTimeReport(size_t NumEntries);
+JobStats *getJobStats(size_t Index);
+void finishJobStats(JobStats *Stats);
+void setJobStatus(size_t Index, bool OK);
+bool writeTimeReport(const std::vector<ReportEntry> &Entries);
+
+// Input Classification
+
+enum InputKind {
+  INPUT_UNKNOWN,
+  INPUT_BITCODE,          // raw or wrapped bitcode
+  INPUT_EMBEDDED_BITCODE, // native object with a bitcode section
+  INPUT_NATIVE_OBJECT,    // ELF, Mach-O or COFF object without bitcode
+  INPUT_ARCHIVE,
+  INPUT_THIN_ARCHIVE      // GNU thin archive, members stay in their files
+};
+
+InputKind classifyInput(StringRef Data);
+InputKind classifyFile(const std::string &Path);
+
+// Native Object Passthrough
+
+void initPassthrough(); // before any job is forked
+uint64_t copyFileRange(int FromFD, uint64_t Offset, int ToFD, uint64_t Length);
+bool passthroughFile(const std::string &From, const std::string &To);
+void addCopiedBytes(uint64_t Length);
+void printPassthroughStats();
+
+// Low Memory Emitter
+
+bool initLowMemory();
+
+// Split CodeGen
+
+bool initSplitCodeGen();
+// Job slots (threads) a module takes, its partitions are generated in
+// parallel.
+unsigned getSplitSlots();
+bool splitCodeGen(LTOCodeGenerator &CodeGen, const std::string &Path,
+                  const std::string &TripleStr, const CodeGenOptions &Opts,
+                  std::unique_ptr<MemoryBuffer> &Out, std::string &errMsg);
+
+// Sample Profiles
+
+bool initProfile();
+const std::string &getProfileKey(); // hash of the -profile, or empty
+// Attaches the -profile to M, before optimization.
+bool applyProfile(Module &M, const std::string &Path);
+
+// Export Lists
+
+bool initExports(const std::vector<InputFile> &Inputs);
+// Whether Name stays preserved, true for everything without a list.
+bool isExported(StringRef Name);
+// Hash of the exported symbols that the bitcode Data defines, or empty.
+std::string getExportsKey(StringRef Data);
+
+// Variants
+
+struct Variant {
+  std::string Name;
+  std::string Target;
+  std::string CPU;
+  std::string Attrs;
+  std::string Key; // changes with the definition of the variant
+
+  CodeGenOptions apply(const CodeGenOptions &Opts) const;
+};
+
+bool initVariants();
+const std::vector<Variant> &getVariants();
+// Job slots (threads) a module takes, its variants are generated in
+// parallel.
+unsigned getVariantSlots();
+std::string getVariantPath(const std::string &OutPath, size_t Index);
+bool compileVariants(LTOCodeGenerator &CodeGen, const std::string &Path,
+                     StringRef Data, const std::string &TripleStr,
+                     const CodeGenOptions &Opts,
+                     std::vector<std::unique_ptr<MemoryBuffer>> &Objects,
+                     std::string &errMsg);
+
+// ThinLTO
+
+bool initThinLTO();
+
+class ThinLTOIndex {
+public:
+  size_t addSummary(const std::string &Name, StringRef Data, bool &OK);
+  bool importFunctions(size_t Index, std::string &Bitcode) const;
+
+private:
+  struct ModuleInfo {
+    std::string Name;
+    StringRef Data;
+    std::string Triple;
+  };
+
+  struct FunctionInfo {
+    size_t Module;
+    bool Importable;
+  };
+
+  std::vector<ModuleInfo> Modules;
+  std::map<std::string, FunctionInfo> Functions;
+};
+
+// Object Transport
+
+// Hands the objects of forked jobs back to the parent through anonymous
+// shared memory files (memfd), instead of temporary files.
+bool initObjectTransport();
+bool hasObjectTransport();
+int createObjectFD(); // -1 on failure
+bool writeObjectFD(int FD, const void *Data, size_t Length);
+std::unique_ptr<MemoryBuffer> readObjectFD(int FD); // closes FD
+
+// NUMA Placement
+
+bool initNUMA();
+int acquireNode(); // the least busy node, -1 without -numa
+void releaseNode(int Node);
+int getWorkerNode(size_t Worker); // of the -engine=prefork worker
+// Runs the calling thread on the node's CPUs, allocating from its memory.
+void bindToNode(int Node);
+
+// Pre-forked Workers
+
+// A job, as far as a worker process (-engine=prefork) needs to know it.
+
+struct WorkerJob {
+  std::string Path;    // of the bitcode file, or of the file a member is in
+  std::string Archive; // of the member, empty for a bitcode file
+  std::string Name;    // of the member
+  uint64_t Offset = 0; // of the member in Path
+  uint64_t Size = 0;   // of the member
+  std::vector<std::string> OutPaths; // one per -variant, or just one
+  std::vector<int> ObjectFDs;        // to write to instead, if any
+  CodeGenOptions Opts;
+  size_t Index = 0;   // into the time report
+  unsigned Slots = 1; // see JobSlots
+};
+
+typedef std::function<bool(const WorkerJob &Job, JobStats *Stats)> WorkerRun;
+
+// Forks NumJobs workers that run their jobs with Run, must be called
+// before any input is mapped.
+bool initWorkers(const WorkerRun &Run);
+void finishWorkers();
+bool submitWorkerJob(const WorkerJob &Job, unsigned long ID);
+// False if Block is false and no worker is done.
+bool waitForWorker(unsigned long &ID, bool &OK, bool Block);
+
+// Target Initialization
+
+// Initializes the backends for the target triples of the inputs (and
+// their '-target') only. Returns the number of initialized backends.
+size_t initTargets(const std::vector<InputFile> &Inputs);
+size_t initAllTargets();
+size_t getNumBackends();
+
+// Server
+
+// Serves requests of bc2obj-client on the Unix socket at Path. Every
+// request runs in a forked child, Run gets the arguments of the client.
+int runServer(const std::string &Path,
+              const std::function<int(int argc, char **argv)> &Run);
+
+// Lets the server prepare codegen state for the target of a module.
+void noteTarget(const std::string &Triple, const std::string &CPU,
+                const std::string &Attrs);
+
+// Archive Writer
+
+struct ArchiveMember {
+  std::string Name;
+  StringRef Data;
+  std::vector<std::string> Symbols;
+  int SourceFD = -1; // stream Data from here if possible
+  uint64_t SourceOffset = 0;
+};
+
+bool writeArchive(const std::string &Path,
+                  const std::vector<ArchiveMember> &Members);
 
 // Classes
 
 class BitCodeArchive {
 public:
+  struct Member {
+    std::string Name;
+    StringRef Data;
+    int SourceFD;          // to stream Data from, or -1
+    uint64_t SourceOffset; // of Data in SourceFD (and in SourcePath)
+    std::string SourcePath; // the file Data is in
+  };
+
   BitCodeArchive(const std::string &Path, bool &OK);
   ~BitCodeArchive();
 
-  const object::Archive &getArchive() { return *Archive; }
+  const std::vector<Member> &getMembers() const { return Members; }
+
+private:
   static std::string
   getObjName(const llvm::object::Archive::child_iterator &child);
 
-private:
+  bool readArchive(const std::string &Path);
+  bool readThinArchive(const std::string &Path);
+
   ErrorOr<std::unique_ptr<MemoryBuffer>> Buf;
   object::Archive *Archive;
+  int FD;
+  std::vector<Member> Members;
+  std::vector<std::unique_ptr<MemoryBuffer>> MemberBufs; // of thin archives
+};
+
+// Maps the members of an output archive to the keys (bitcode hash and
+// options) they were generated from, so that unchanged members can be
+// taken over from the previous output archive.
+
+class ArchiveManifest {
+public:
+  ArchiveManifest(const std::string &ArchivePath);
+
+  // The member of the previous output archive generated from the same
+  // bitcode with the same options, or nullptr.
+  const BitCodeArchive::Member *lookup(const std::string &Key,
+                                       const std::string &Name) const;
+
+  // Members have to be added in archive order.
+  void addMember(const std::string &Key, const std::string &Name);
+  bool write() const;
+
+  static std::string getPath(const std::string &ArchivePath);
+
+private:
+  static std::string getEntry(const std::string &Key, const std::string &Name);
+  bool load();
+
+  std::string ArchivePath;
+  std::unique_ptr<BitCodeArchive> Previous;
+  std::map<std::string, size_t> PreviousEntries; // -> member index
+  std::vector<std::string> Entries;
 };
 
 class BitCodeModule {
   friend class NativeCodeGenerator;
 
 public:
-  BitCodeModule(const std::string &Path, bool &OK);
-  BitCodeModule(const std::string &Path, StringRef Data, bool &OK);
+  BitCodeModule(const std::string &Path);
   ~BitCodeModule();
 
+  bool parse(StringRef Data, LLVMContext *Context);
+
 private:
   void check(const std::string &errMsg, const std::string &Path, bool &OK);
   void setTriple(bool &OK);
 
-  bool isNativeObjectFile;
+  std::string Path;
   TargetOptions TargetOpts;
   LTOModule *Module;
   std::string TripleStr;
@@ -145,11 +537,8 @@ private:
 
 class NativeCodeGenerator {
 public:
-  NativeCodeGenerator(const std::string &Path, bool &OK,
-                      bool &isNativeObjectFile);
-
-  NativeCodeGenerator(const std::string &Path, StringRef Data, bool &OK,
-                      bool &isNativeObjectFile);
+  NativeCodeGenerator(const std::string &Path);
+  NativeCodeGenerator(const std::string &Path, StringRef Data);
 
   const char *getObjFileName() const { return getFileName(Path.c_str()); }
 
@@ -157,29 +546,58 @@ public:
   bool generateNativeCodeMemory();
 
   bool writeCodeToDisk(const std::string &Dir);
+  bool writeCodeToFile(const std::string &Path);
+  bool writeCodeToFile(const std::string &Path, size_t Index);
+  bool writeCodeToFD(int FD); // see createObjectFD()
+  bool writeCodeToFD(int FD, size_t Index);
 
   struct Code;
   const Code &getCode() { return code; }
+  Code takeCode();
+  Code takeCode(size_t Index); // -variant
+
+  void setJobStats(JobStats *Stats) { this->Stats = Stats; }
+  void setPartition() { Partition = true; }
+  void setVariant() { Variant = true; }
+  void setOptions(const CodeGenOptions &Opts) { this->Opts = Opts; }
+  void setOutputPath(const std::string &Path) { OutPath = Path; }
 
   const char *getOutputPath() { return OutPath.c_str(); }
 
   struct Code {
-#if LLVM_VERSION_GE(3, 7)
     std::unique_ptr<MemoryBuffer> CodeBuf;
-#endif
-    const void *Code;
-    size_t Length;
+    const void *Code = nullptr;
+    size_t Length = 0;
+    std::vector<std::string> Symbols;
   };
 
 private:
+  LLVMContext *getContext();
   const char *getDefaultTargetCPU() const;
   bool setupCodeGenOpts();
+  void parseLLVMOpts();
+  bool usePICOpts() const;
+  bool parseModule();
+  bool compileModule(std::string &errMsg);
+
+  // -low-memory
+  bool parseModuleLazily();
+  bool setupTargetMachine();
+  bool compileModuleLazily(std::string &errMsg);
   void setOutPutPath();
 
   std::string Path;
   std::string OutPath;
+  LTOCodeGenerator CodeGen; // must outlive BCModule (owns the context)
   BitCodeModule BCModule;
-  LTOCodeGenerator CodeGen;
+  std::unique_ptr<Module> LazyModule;
+  std::unique_ptr<TargetMachine> TM;
   StringRef Data;
+  std::unique_ptr<MemoryBuffer> FileBuf;
   Code code;
+  std::vector<Code> VariantCodes; // -variant, in the order of getVariants()
+  JobStats *Stats = nullptr;
+  CodeGenOptions Opts;
+  bool Partition = false; // an already optimized -split-codegen partition
+  bool Variant = false;   // generates one -variant of another generator
 };
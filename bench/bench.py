@@ -0,0 +1,356 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy
+# of this software and associated documentation files (the "Software"), to deal
+# in the Software without restriction, including without limitation the rights
+# to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+# copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in
+# all copies or substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+# IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+# FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+# AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+# LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+# THE SOFTWARE.
+#
+
+"""bc2obj benchmark harness.
+
+Generates synthetic bitcode corpora (deterministically, from a fixed seed),
+runs bc2obj over them with a matrix of -j values, -O levels and execution
+engines and reports throughput, per-module latency and peak memory.
+
+Per-module numbers come from bc2obj's -time-report output.  Results can be
+saved with --save and compared against a previous run with --baseline; the
+script exits with status 1 if any configuration got slower than --threshold.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+SEED = 20141001
+CORPUS_VERSION = 1  # bump when the generators below change
+
+TRIPLES = ["x86_64-unknown-linux-gnu", "i686-unknown-linux-gnu",
+           "aarch64-unknown-linux-gnu", "armv7-unknown-linux-gnueabihf"]
+
+# Corpus generation
+
+def gen_function(rng, name, size):
+    """Returns a C function with roughly <size> statements."""
+    lines = ["int %s(int *a, int n) {" % name,
+             "  int x = %d, i;" % rng.randint(1, 99)]
+    for s in range(size):
+        kind = rng.randint(0, 3)
+        c = rng.randint(1, 1000)
+        if kind == 0:
+            lines.append("  for (i = 0; i < n; ++i) x += a[i] * %d;" % c)
+        elif kind == 1:
+            lines.append("  if (x & %d) x ^= %d; else x += n;" % (c, c * 7))
+        elif kind == 2:
+            lines.append("  switch (x %% 4) { case 0: x += %d; break; "
+                         "case 1: x -= a[%d %% (n + 1)]; break; "
+                         "default: x *= 3; }" % (c, s))
+        else:
+            lines.append("  x = (x << 3) ^ (x >> %d);" % (c % 31 + 1))
+    lines.append("  return x;")
+    lines.append("}")
+    return "\n".join(lines)
+
+
+def gen_module(rng, prefix, functions, size):
+    funcs = [gen_function(rng, "%s_%d" % (prefix, i), size)
+             for i in range(functions)]
+    return "\n\n".join(funcs) + "\n"
+
+
+class Toolchain:
+    def __init__(self, llvm_config):
+        bindir = subprocess.check_output([llvm_config, "--bindir"],
+                                         universal_newlines=True).strip()
+        self.clang = self.find(bindir, "clang")
+        self.ar = self.find(bindir, "llvm-ar") or shutil.which("ar")
+        if not self.clang:
+            sys.exit("bench: clang not found in %s or $PATH" % bindir)
+        if not self.ar:
+            sys.exit("bench: no archiver found")
+
+    @staticmethod
+    def find(bindir, name):
+        path = os.path.join(bindir, name)
+        return path if os.access(path, os.X_OK) else shutil.which(name)
+
+    def compile(self, src, obj, triple, bitcode):
+        cmd = [self.clang, "--target=" + triple, "-O1", "-c", src, "-o", obj]
+        if bitcode:
+            cmd.insert(1, "-flto")
+        return subprocess.call(cmd, stderr=subprocess.DEVNULL) == 0
+
+    def archive(self, path, members):
+        if os.path.exists(path):
+            os.unlink(path)
+        subprocess.check_call([self.ar, "rcs", path] + members)
+
+
+def usable_triples(tc, workdir):
+    """Returns the triples this clang can generate code for."""
+    src = os.path.join(workdir, "probe.c")
+    with open(src, "w") as f:
+        f.write("int probe(void) { return 0; }\n")
+    triples = [t for t in TRIPLES
+               if tc.compile(src, os.path.join(workdir, "probe.o"), t, True)]
+    if not triples:
+        sys.exit("bench: clang cannot emit bitcode for any known triple")
+    return triples
+
+
+def write_objects(tc, dir, rng, count, functions, size, triples, bitcode=True):
+    os.makedirs(dir, exist_ok=True)
+    objs = []
+    for i in range(count):
+        src = os.path.join(dir, "m%04d.c" % i)
+        obj = os.path.join(dir, "m%04d.o" % i)
+        with open(src, "w") as f:
+            f.write(gen_module(rng, "%s_m%d" % (os.path.basename(dir), i),
+                               functions, size))
+        if not tc.compile(src, obj, triples[i % len(triples)], bitcode):
+            sys.exit("bench: cannot compile %s" % src)
+        os.unlink(src)
+        objs.append(obj)
+    return objs
+
+
+def build_corpora(tc, workdir, scale):
+    """Builds the corpora once per (version, scale); later runs reuse them."""
+    root = os.path.join(workdir, "corpus-v%d-s%g" % (CORPUS_VERSION, scale))
+    stamp = os.path.join(root, "corpus.json")
+
+    if os.path.exists(stamp):
+        with open(stamp) as f:
+            return json.load(f)
+
+    if os.path.exists(root):
+        shutil.rmtree(root)
+    os.makedirs(root)
+
+    rng = random.Random(SEED)
+    triples = usable_triples(tc, root)
+    host = triples[:1]
+    n = lambda x: max(1, int(x * scale))
+    corpora = {}
+
+    print("bench: generating corpora in %s" % root, file=sys.stderr)
+
+    corpora["tiny"] = write_objects(tc, os.path.join(root, "tiny"), rng,
+                                    n(400), 2, 4, host)
+    corpora["huge"] = write_objects(tc, os.path.join(root, "huge"), rng,
+                                    n(4), n(300), 60, host)
+
+    for i in range(n(4)):
+        dir = os.path.join(root, "archive%d" % i)
+        members = (write_objects(tc, dir, rng, n(30), 4, 20, host) +
+                   write_objects(tc, os.path.join(dir, "native"), rng,
+                                 n(10), 4, 20, host, bitcode=False))
+        path = os.path.join(root, "mixed%d.a" % i)
+        tc.archive(path, members)
+        corpora.setdefault("archives", []).append(path)
+
+    corpora["triples"] = write_objects(tc, os.path.join(root, "triples"), rng,
+                                       n(16) * len(triples), 8, 20, triples)
+
+    with open(stamp, "w") as f:
+        json.dump(corpora, f, indent=2)
+
+    return corpora
+
+# Running bc2obj
+
+def supported_options(bc2obj):
+    help = subprocess.run([bc2obj, "-help"], stdout=subprocess.PIPE,
+                          stderr=subprocess.STDOUT,
+                          universal_newlines=True).stdout
+    return {"O": "-O=" in help, "thread": "=thread" in help}
+
+
+def percentile(values, p):
+    if not values:
+        return 0.0
+    values = sorted(values)
+    k = (len(values) - 1) * p / 100.0
+    lo = int(k)
+    hi = min(lo + 1, len(values) - 1)
+    return values[lo] + (values[hi] - values[lo]) * (k - lo)
+
+
+def run_once(bc2obj, inputs, args, workdir):
+    outdir = os.path.join(workdir, "out")
+    report = os.path.join(workdir, "report.json")
+
+    if os.path.exists(outdir):
+        shutil.rmtree(outdir)
+
+    cmd = [bc2obj, "-out-dir=" + outdir, "-time-report=" + report] + args
+
+    # stderr goes to a file, a full pipe would block bc2obj while we are
+    # waiting for it (wait4() for its rusage).
+    with tempfile.TemporaryFile(dir=workdir) as errfile:
+        start = time.monotonic()
+        proc = subprocess.Popen(cmd + inputs, stdout=subprocess.DEVNULL,
+                                stderr=errfile)
+        _, status, usage = os.wait4(proc.pid, 0)
+        wall = time.monotonic() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        errfile.seek(0)
+        err = errfile.read().decode(errors="replace")
+
+    if proc.returncode != 0:
+        sys.exit("bench: %s failed:\n%s" % (" ".join(cmd), err))
+
+    with open(report) as f:
+        data = json.load(f)
+
+    latencies = []
+    peak = usage.ru_maxrss * 1024
+
+    for module in data["modules"]:
+        if module.get("passthrough"):
+            continue
+        phases = module["phases"].values()
+        latencies.append(sum(phase["wall"] for phase in phases))
+        peak = max(peak, module["peak_rss"])
+
+    return wall, latencies, peak, len(data["modules"])
+
+
+def run_config(bc2obj, inputs, args, workdir, repeat):
+    size = sum(os.path.getsize(path) for path in inputs)
+    walls, latencies, peak, modules = [], [], 0, 0
+
+    for _ in range(repeat):
+        wall, lat, rss, modules = run_once(bc2obj, inputs, args, workdir)
+        walls.append(wall)
+        latencies += lat
+        peak = max(peak, rss)
+
+    wall = percentile(walls, 50)
+    return {
+        "wall": wall,
+        "modules_per_s": modules / wall,
+        "mb_per_s": size / wall / (1 << 20),
+        "p50": percentile(latencies, 50),
+        "p99": percentile(latencies, 99),
+        "peak_rss_mb": peak / float(1 << 20),
+    }
+
+# Reporting
+
+def print_results(results):
+    header = ("%-34s %8s %10s %8s %9s %9s %9s" %
+              ("config", "wall[s]", "modules/s", "MB/s", "p50[ms]",
+               "p99[ms]", "rss[MB]"))
+    print(header)
+    print("-" * len(header))
+    for name, r in results.items():
+        print("%-34s %8.3f %10.1f %8.2f %9.2f %9.2f %9.1f" %
+              (name, r["wall"], r["modules_per_s"], r["mb_per_s"],
+               r["p50"] * 1000, r["p99"] * 1000, r["peak_rss_mb"]))
+
+
+def compare(results, baseline, threshold):
+    regressed = False
+    for name, r in results.items():
+        base = baseline.get(name)
+        if not base:
+            continue
+        for key in ("wall", "p99", "peak_rss_mb"):
+            if base[key] > 0 and r[key] > base[key] * (1 + threshold):
+                print("bench: REGRESSION %s: %s %.3f -> %.3f (+%.0f%%)" %
+                      (name, key, base[key], r[key],
+                       (r[key] / base[key] - 1) * 100), file=sys.stderr)
+                regressed = True
+    return regressed
+
+
+def int_list(value):
+    return [int(v) for v in value.split(",") if v]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--bc2obj", default="./bc2obj")
+    parser.add_argument("--llvm-config", default="llvm-config")
+    parser.add_argument("--workdir", default="bench/work")
+    parser.add_argument("--scale", type=float, default=1.0,
+                        help="corpus size multiplier (e.g. 0.1 for a quick run)")
+    parser.add_argument("--jobs", type=int_list,
+                        default=[1, os.cpu_count() or 1])
+    parser.add_argument("--opt", type=int_list, default=[0, 2])
+    parser.add_argument("--engines", default="fork,thread")
+    parser.add_argument("--corpora", default="tiny,huge,archives,triples")
+    parser.add_argument("--repeat", type=int, default=3)
+    parser.add_argument("--save", help="write results as JSON to this file")
+    parser.add_argument("--baseline", help="compare against a saved run")
+    parser.add_argument("--threshold", type=float, default=0.10,
+                        help="allowed slowdown vs. the baseline (default 0.10)")
+    opts = parser.parse_args()
+
+    bc2obj = os.path.abspath(opts.bc2obj)
+    os.makedirs(opts.workdir, exist_ok=True)
+
+    tc = Toolchain(opts.llvm_config)
+    corpora = build_corpora(tc, opts.workdir, opts.scale)
+    supported = supported_options(bc2obj)
+
+    engines = opts.engines.split(",")
+    if "thread" in engines and not supported["thread"]:
+        print("bench: thread engine not available, skipping",
+              file=sys.stderr)
+        engines.remove("thread")
+
+    levels = opts.opt if supported["O"] else [None]
+    results = {}
+
+    for corpus in opts.corpora.split(","):
+        inputs = corpora[corpus]
+        for engine in engines:
+            for level in levels:
+                for jobs in sorted(set(opts.jobs)):
+                    args = ["-j%d" % jobs, "-engine=" + engine]
+                    name = "%s/%s/j%d" % (corpus, engine, jobs)
+                    if level is not None:
+                        args.append("-O%d" % level)
+                        name += "/O%d" % level
+                    print("bench: %s" % name, file=sys.stderr)
+                    results[name] = run_config(bc2obj, inputs, args,
+                                               opts.workdir, opts.repeat)
+
+    print_results(results)
+
+    if opts.save:
+        with open(opts.save, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+
+    if opts.baseline:
+        with open(opts.baseline) as f:
+            if compare(results, json.load(f), opts.threshold):
+                return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
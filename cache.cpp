@@ -0,0 +1,216 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+
+#include "bc2obj.h"
+
+namespace {
+
+struct CacheStats {
+  uint64_t Hits;
+  uint64_t Misses;
+};
+
+CacheStats *Stats;
+
+std::string getCachePath(const std::string &Key) {
+  std::string Path = CacheDir;
+  Path += PATH_DIV;
+  Path += Key;
+  Path += ".o";
+  return Path;
+}
+
+void addOption(MD5 &Hash, StringRef Val) {
+  Hash.update(Val);
+  Hash.update(StringRef("", 1));
+}
+
+void addOption(MD5 &Hash, unsigned Val) {
+  addOption(Hash, StringRef(std::to_string(Val)));
+}
+
+void pruneObjectCache() {
+  struct Entry {
+    std::string Path;
+    uint64_t Time;
+    uint64_t Size;
+  };
+
+  std::vector<Entry> Entries;
+  uint64_t TotalSize = 0;
+  std::error_code EC;
+
+  for (sys::fs::directory_iterator I(CacheDir.getValue(), EC), E; I != E && !EC;
+       I.increment(EC)) {
+    const std::string &Path = I->path();
+    sys::fs::file_status Status;
+
+    if (sys::path::extension(Path) != ".o" || sys::fs::status(Path, Status))
+      continue;
+
+    Entries.push_back({Path, Status.getLastModificationTime().toEpochTime(),
+                       Status.getSize()});
+    TotalSize += Status.getSize();
+  }
+
+  uint64_t MaxSize = uint64_t(CacheSize) * 1024 * 1024;
+
+  if (TotalSize <= MaxSize)
+    return;
+
+  // Least recently used entries first, hits refresh the time stamp.
+  std::sort(Entries.begin(), Entries.end(),
+            [](const Entry &A, const Entry &B) { return A.Time < B.Time; });
+
+  for (auto &Entry : Entries) {
+    if (TotalSize <= MaxSize)
+      break;
+
+    if (!sys::fs::remove(Entry.Path))
+      TotalSize -= Entry.Size;
+  }
+}
+
+} // end unnamed namespace
+
+bool initObjectCache() {
+  if (CacheDir.empty())
+    return true;
+
+  if (sys::fs::create_directories(CacheDir.getValue())) {
+    errmsg("cannot create directory " << CacheDir);
+    return false;
+  }
+
+  Stats = static_cast<CacheStats *>(allocSharedMemory(sizeof(CacheStats)));
+  return true;
+}
+
+bool isObjectCacheEnabled() { return !!Stats; }
+
+std::string getObjectCacheKey(StringRef Data, const CodeGenOptions &Opts) {
+  MD5 Hash;
+  MD5::MD5Result Result;
+  SmallString<32> Key;
+
+  addOption(Hash, Data);
+  addOption(Hash, LLVM_VERSION_MAJOR);
+  addOption(Hash, LLVM_VERSION_MINOR);
+#ifdef LLVM_VERSION_PATCH
+  addOption(Hash, LLVM_VERSION_PATCH);
+#endif
+
+  addOption(Hash, Opts.Target);
+  addOption(Hash, Opts.CPU);
+  addOption(Hash, Opts.Attrs);
+  addOption(Hash, Opts.PIC);
+  addOption(Hash, Opts.PIE);
+  addOption(Hash, Opts.GenerateDebugSymbols);
+  addOption(Hash, CodeGenOnly);
+  addOption(Hash, LowMemory);
+  addOption(Hash, DisableInlinePass);
+  addOption(Hash, DisableGVNPass);
+#if LLVM_VERSION_LT(3, 7)
+  addOption(Hash, DisableOptimizations);
+#else
+  addOption(Hash, Opts.OptLevel);
+#endif
+#if LLVM_VERSION_GE(3, 6)
+  addOption(Hash, DisableVectorizationPass);
+#endif
+
+  addOption(Hash, SplitCodeGen);
+
+  addOption(Hash, LLVMOpts.size());
+  for (auto &LLVMOpt : LLVMOpts)
+    addOption(Hash, LLVMOpt);
+
+  addOption(Hash, getProfileKey());
+  addOption(Hash, getExportsKey(Data));
+
+  Hash.final(Result);
+  MD5::stringifyResult(Result, Key);
+
+  return Key.str();
+}
+
+bool lookupObjectCache(const std::string &Key,
+                       std::unique_ptr<MemoryBuffer> &Buf) {
+  std::string Path = getCachePath(Key);
+  auto CachedBuf = MemoryBuffer::getFile(Path.c_str(), -1, false);
+
+  if (CachedBuf.getError())
+    return false;
+
+  int fd;
+
+  if (!sys::fs::openFileForRead(Path, fd)) {
+    sys::fs::setLastModificationAndAccessTime(fd, sys::TimeValue::now());
+    close(fd);
+  }
+
+  Buf = moveMemBuffer(CachedBuf.get());
+  __sync_fetch_and_add(&Stats->Hits, 1);
+  return true;
+}
+
+bool storeObjectCache(const std::string &Key, const void *Code,
+                      size_t Length) {
+  __sync_fetch_and_add(&Stats->Misses, 1);
+
+  std::string Model = CacheDir;
+  Model += PATH_DIV;
+  Model += "tmp-%%%%%%%%";
+
+  int fd;
+  SmallString<128> TmpPath;
+
+  if (sys::fs::createUniqueFile(Model, fd, TmpPath))
+    return false;
+
+  bool OK = write(fd, Code, Length) == (ssize_t)Length;
+  close(fd);
+
+  // Rename, so concurrent readers never see a partially written entry.
+  if (!OK || sys::fs::rename(TmpPath.c_str(), getCachePath(Key))) {
+    sys::fs::remove(TmpPath.c_str());
+    return false;
+  }
+
+  return true;
+}
+
+void finishObjectCache() {
+  if (!Stats)
+    return;
+
+  pruneObjectCache();
+
+  errmsg("object cache: " << Stats->Hits << " hit"
+                          << (Stats->Hits != 1 ? "s" : "") << ", "
+                          << Stats->Misses << " miss"
+                          << (Stats->Misses != 1 ? "es" : ""));
+}
@@ -0,0 +1,94 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+
+#include "bc2obj.h"
+
+namespace {
+
+bool isNativeObject(sys::fs::file_magic Magic) {
+  switch (Magic) {
+  case sys::fs::file_magic::elf_relocatable:
+  case sys::fs::file_magic::macho_object:
+  case sys::fs::file_magic::macho_universal_binary:
+  case sys::fs::file_magic::coff_object:
+  case sys::fs::file_magic::coff_import_library:
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Everything but native objects can be told apart by their first bytes.
+// identify_magic() knows raw and wrapped bitcode, archives and objects.
+
+InputKind classifyHeader(StringRef Header, sys::fs::file_magic &Magic) {
+  Magic = sys::fs::identify_magic(Header);
+
+  switch (Magic) {
+  case sys::fs::file_magic::bitcode:
+    return INPUT_BITCODE;
+  case sys::fs::file_magic::archive:
+    return Header.startswith("!<thin>\n") ? INPUT_THIN_ARCHIVE : INPUT_ARCHIVE;
+  default:
+    return isNativeObject(Magic) ? INPUT_NATIVE_OBJECT : INPUT_UNKNOWN;
+  }
+}
+
+} // end unnamed namespace
+
+InputKind classifyInput(StringRef Data) {
+  sys::fs::file_magic Magic;
+  InputKind Kind = classifyHeader(Data, Magic);
+
+  // Objects may carry a bitcode section, finding it only needs
+  // the section table.
+  if (Kind == INPUT_NATIVE_OBJECT &&
+      LTOModule::isBitcodeFile(Data.data(), Data.size()))
+    return INPUT_EMBEDDED_BITCODE;
+
+  return Kind;
+}
+
+InputKind classifyFile(const std::string &Path) {
+  char Header[32];
+  ssize_t Length;
+  int FD;
+
+  if (sys::fs::openFileForRead(Path, FD))
+    return INPUT_UNKNOWN;
+
+  Length = read(FD, Header, sizeof(Header));
+  close(FD);
+
+  if (Length <= 0)
+    return INPUT_UNKNOWN;
+
+  sys::fs::file_magic Magic;
+  InputKind Kind = classifyHeader(StringRef(Header, Length), Magic);
+
+  if (Kind == INPUT_NATIVE_OBJECT && LTOModule::isBitcodeFile(Path.c_str()))
+    return INPUT_EMBEDDED_BITCODE;
+
+  return Kind;
+}
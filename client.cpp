@@ -0,0 +1,197 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// bc2obj-client: runs bc2obj in a 'bc2obj -server=<socket>' process,
+// which has the targets already initialized. Takes the same options as
+// bc2obj. The socket is given by '-server=<socket>' (as first argument)
+// or by BC2OBJ_SERVER. Without a reachable server, bc2obj (or
+// $BC2OBJ) is run directly.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#endif
+
+#include "server.h"
+
+namespace {
+
+#ifndef _WIN32
+
+int connectToServer(const char *Path) {
+  struct sockaddr_un Addr;
+
+  if (strlen(Path) >= sizeof(Addr.sun_path))
+    return -1;
+
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  strcpy(Addr.sun_path, Path);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  if (fd == -1)
+    return -1;
+
+  if (connect(fd, reinterpret_cast<sockaddr *>(&Addr), sizeof(Addr))) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+bool writeAll(int fd, const void *Data, size_t Length) {
+  const char *Ptr = static_cast<const char *>(Data);
+
+  while (Length > 0) {
+    ssize_t Written = write(fd, Ptr, Length);
+
+    if (Written < 0 && errno == EINTR)
+      continue;
+
+    if (Written <= 0)
+      return false;
+
+    Ptr += Written;
+    Length -= Written;
+  }
+
+  return true;
+}
+
+bool sendRequest(int fd, const std::string &Data) {
+  RequestHeader Header = {ServerMagic, static_cast<uint32_t>(Data.size())};
+  int FDs[2] = {STDOUT_FILENO, STDERR_FILENO};
+  char Control[CMSG_SPACE(sizeof(FDs))];
+  struct iovec IOV = {&Header, sizeof(Header)};
+  struct msghdr Msg;
+
+  memset(&Msg, 0, sizeof(Msg));
+  memset(Control, 0, sizeof(Control));
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control;
+  Msg.msg_controllen = sizeof(Control);
+
+  struct cmsghdr *CMsg = CMSG_FIRSTHDR(&Msg);
+  CMsg->cmsg_level = SOL_SOCKET;
+  CMsg->cmsg_type = SCM_RIGHTS;
+  CMsg->cmsg_len = CMSG_LEN(sizeof(FDs));
+  memcpy(CMSG_DATA(CMsg), FDs, sizeof(FDs));
+
+  if (sendmsg(fd, &Msg, 0) != sizeof(Header))
+    return false;
+
+  return writeAll(fd, Data.data(), Data.size());
+}
+
+#endif
+
+int runDirectly(char **Argv) {
+  const char *BC2Obj = getenv("BC2OBJ");
+
+  if (!BC2Obj)
+    BC2Obj = "bc2obj";
+
+  Argv[0] = const_cast<char *>(BC2Obj);
+  execvp(BC2Obj, Argv);
+
+  fprintf(stderr, "bc2obj-client: cannot execute %s\n", BC2Obj);
+  return 1;
+}
+
+} // end unnamed namespace
+
+int main(int argc, char **argv) {
+  const char *Path = getenv("BC2OBJ_SERVER");
+  int First = 1;
+
+  if (argc > 1 && !strncmp(argv[1], "-server=", 8)) {
+    Path = argv[1] + 8;
+    First = 2;
+  }
+
+  // Drop '-server=<socket>'.
+  argv[First - 1] = argv[0];
+  char **Argv = argv + First - 1;
+
+#ifndef _WIN32
+  int fd = Path && *Path ? connectToServer(Path) : -1;
+
+  if (fd == -1)
+    return runDirectly(Argv);
+
+  char Dir[4096];
+
+  if (!getcwd(Dir, sizeof(Dir))) {
+    fprintf(stderr, "bc2obj-client: cannot get the working directory\n");
+    return 1;
+  }
+
+  std::string Data = Dir;
+  Data += '\0';
+
+  for (char **Arg = Argv; *Arg; ++Arg) {
+    Data += *Arg;
+    Data += '\0';
+  }
+
+  if (Data.size() > MaxRequestLength || !sendRequest(fd, Data)) {
+    fprintf(stderr, "bc2obj-client: cannot send request to %s\n", Path);
+    close(fd);
+    return 1;
+  }
+
+  int32_t Status;
+  size_t Read = 0;
+
+  while (Read < sizeof(Status)) {
+    ssize_t N = read(fd, reinterpret_cast<char *>(&Status) + Read,
+                     sizeof(Status) - Read);
+
+    if (N < 0 && errno == EINTR)
+      continue;
+
+    if (N <= 0) {
+      // The request died without an exit status (i.e. invalid options).
+      Status = 1;
+      break;
+    }
+
+    Read += N;
+  }
+
+  close(fd);
+  return Status;
+#else
+  (void)Path;
+  return runDirectly(Argv);
+#endif
+}
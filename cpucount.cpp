@@ -35,6 +35,9 @@
 #define __USE_GNU
 #include <sched.h>
 #undef __USE_GNU
+#include <cstdio>
+#include <cstring>
+#include <string>
 #endif /* __linux__ */
 
 #if defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__) ||     \
@@ -49,6 +52,143 @@
 #endif /* HW_AVAILCPU */
 #endif /* BSD */
 
+#ifdef __linux__
+namespace {
+
+// The cgroup of this process: the path of the unified (v2) hierarchy,
+// or the one of the given v1 controller.
+
+bool getCgroup(const char *controller, std::string &dir, bool &v2) {
+  FILE *f = fopen("/proc/self/cgroup", "r");
+  char line[4096];
+  bool found = false;
+
+  if (!f)
+    return false;
+
+  while (fgets(line, sizeof(line), f)) {
+    char *controllers = strchr(line, ':');
+    char *path = controllers ? strchr(controllers + 1, ':') : NULL;
+
+    if (!path)
+      continue;
+
+    *path++ = '\0';
+    path[strcspn(path, "\n")] = '\0';
+    controllers++;
+
+    if (!*controllers) {
+      // "0::<path>", only used if there's no v1 controller.
+      if (!found) {
+        dir = std::string("/sys/fs/cgroup") + path;
+        v2 = found = true;
+      }
+    } else {
+      std::string list = std::string(",") + controllers + ",";
+
+      if (list.find(std::string(",") + controller + ",") != std::string::npos) {
+        dir = std::string("/sys/fs/cgroup/") + controllers + path;
+        v2 = false;
+        found = true;
+        break;
+      }
+    }
+  }
+
+  fclose(f);
+  return found;
+}
+
+bool readCgroupFile(const std::string &path, char *buf, size_t size) {
+  FILE *f = fopen(path.c_str(), "r");
+
+  if (!f)
+    return false;
+
+  bool ok = fgets(buf, size, f) != NULL;
+  fclose(f);
+  return ok;
+}
+
+// Calls read() for the cgroup and all of its parents, limits of the
+// parents apply as well. Inside a cgroup namespace the path is relative
+// to the mount, that is the root then.
+
+template <typename T>
+void walkCgroup(const char *controller, T read) {
+  std::string dir;
+  bool v2;
+
+  if (!getCgroup(controller, dir, v2))
+    return;
+
+  std::string root = v2 ? "/sys/fs/cgroup" : dir.substr(0, dir.find('/', 15));
+
+  for (;;) {
+    read(dir, v2);
+
+    if (dir.size() <= root.size())
+      break;
+
+    dir.erase(dir.rfind('/'));
+  }
+}
+
+int getCgroupCPULimit() {
+  double limit = 0;
+
+  walkCgroup("cpu", [&](const std::string &dir, bool v2) {
+    char buf[128];
+    long long quota = -1, period = 0;
+
+    if (v2) {
+      // "max 100000" or "<quota> <period>"
+      if (readCgroupFile(dir + "/cpu.max", buf, sizeof(buf)) &&
+          sscanf(buf, "%lld %lld", &quota, &period) != 2)
+        quota = -1;
+    } else {
+      if (readCgroupFile(dir + "/cpu.cfs_quota_us", buf, sizeof(buf)))
+        quota = atoll(buf);
+      if (readCgroupFile(dir + "/cpu.cfs_period_us", buf, sizeof(buf)))
+        period = atoll(buf);
+    }
+
+    if (quota > 0 && period > 0 &&
+        (!limit || (double)quota / period < limit))
+      limit = (double)quota / period;
+  });
+
+  // Round up, a quota of 1.5 CPUs keeps two jobs busy enough.
+  return limit > 0 ? (int)(limit + 0.999) : 0;
+}
+
+int getAffinityCPUCount() {
+  // The CPU set has to be as large as the kernel's, which may well be
+  // more than the 1024 CPUs of cpu_set_t.
+  for (int ncpus = 1024; ncpus <= (1 << 20); ncpus *= 2) {
+    cpu_set_t *cs = CPU_ALLOC(ncpus);
+    size_t size = CPU_ALLOC_SIZE(ncpus);
+
+    if (!cs)
+      return 0;
+
+    CPU_ZERO_S(size, cs);
+
+    if (!sched_getaffinity(0, size, cs)) {
+      int cpucount = CPU_COUNT_S(size, cs);
+      CPU_FREE(cs);
+      return cpucount;
+    }
+
+    CPU_FREE(cs);
+  }
+
+  return 0;
+}
+
+} // end unnamed namespace
+#endif /* __linux__ */
+
 int getCPUCount() {
 #ifdef WIN32
   SYSTEM_INFO sysinfo;
@@ -57,16 +197,13 @@ int getCPUCount() {
   return sysinfo.dwNumberOfProcessors;
 #else
 #ifdef __linux__
-  cpu_set_t cs;
-  int i, cpucount = 0;
-
-  CPU_ZERO(&cs);
-  sched_getaffinity(0, sizeof(cs), &cs);
+  int cpucount = getAffinityCPUCount();
+  int limit = getCgroupCPULimit();
 
-  for (i = 0; i < 128; i++) {
-    if (CPU_ISSET(i, &cs))
-      cpucount++;
-  }
+  // Containers often get a CPU quota instead of fewer CPUs, more jobs
+  // than that would only be throttled.
+  if (limit > 0 && (!cpucount || limit < cpucount))
+    cpucount = limit;
 
   return cpucount ? cpucount : 1;
 #else
@@ -94,3 +231,27 @@ int getCPUCount() {
 #endif /* __linux__ */
 #endif /* WIN32 */
 }
+
+unsigned long long getMemoryLimit() {
+#ifdef __linux__
+  unsigned long long limit = 0;
+
+  walkCgroup("memory", [&](const std::string &dir, bool v2) {
+    char buf[128];
+
+    // "max" (v2) and huge values (v1) mean no limit.
+    if (!readCgroupFile(dir + (v2 ? "/memory.max" : "/memory.limit_in_bytes"),
+                        buf, sizeof(buf)))
+      return;
+
+    unsigned long long value = strtoull(buf, NULL, 10);
+
+    if (value && value < (1ULL << 60) && (!limit || value < limit))
+      limit = value;
+  });
+
+  return limit;
+#else
+  return 0;
+#endif /* __linux__ */
+}
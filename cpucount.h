@@ -20,4 +20,5 @@
   THE SOFTWARE.
  */
 
-int getCPUCount();
+int getCPUCount(); // respects the affinity mask and cgroup CPU quotas
+unsigned long long getMemoryLimit(); // of the cgroup, 0 if unlimited
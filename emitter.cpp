@@ -0,0 +1,244 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// Object emission straight from a lazily loaded module (-low-memory).
+//
+// Code generation runs function by function, so the body of a function
+// is only parsed right before its code is generated and its IR is
+// dropped again as soon as the machine code has been emitted.  Peak
+// memory is then dominated by the largest function instead of the whole
+// module.
+
+#include "bc2obj.h"
+
+#if LLVM_VERSION_GE(3, 7)
+#include <llvm/Analysis/TargetLibraryInfo.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Object/IRObjectFile.h>
+#include <llvm/Pass.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <llvm/Support/TargetRegistry.h>
+#endif
+
+bool initLowMemory() {
+  if (!LowMemory)
+    return true;
+
+#if LLVM_VERSION_GE(3, 7)
+  if (SplitCodeGen > 1) {
+    errmsg("'-low-memory' and '-split-codegen' cannot be combined");
+    return false;
+  }
+
+  return true;
+#else
+  errmsg("'-low-memory' requires LLVM 3.7 or later");
+  return false;
+#endif
+}
+
+#if LLVM_VERSION_GE(3, 7)
+
+namespace {
+
+class MaterializeFunction : public FunctionPass {
+public:
+  static char ID;
+  MaterializeFunction() : FunctionPass(ID) {}
+
+  const char *getPassName() const override { return "Materialize Function"; }
+
+  bool runOnFunction(Function &F) override {
+    if (std::error_code EC = F.materialize())
+      report_fatal_error(F.getName() + ": " + EC.message());
+    return true;
+  }
+};
+
+class ReleaseFunction : public FunctionPass {
+public:
+  static char ID;
+  ReleaseFunction() : FunctionPass(ID) {}
+
+  const char *getPassName() const override { return "Release Function"; }
+
+  bool runOnFunction(Function &F) override {
+    // Only the IR goes away, the symbol has been emitted already. A
+    // declaration would have to be external (deleteBody() makes it so),
+    // later calls to a private or internal function would then refer to
+    // it as an external symbol. An 'unreachable' body keeps the linkage
+    // and the module valid.
+    F.dropAllReferences();
+    new UnreachableInst(F.getContext(),
+                        BasicBlock::Create(F.getContext(), "", &F));
+    return true;
+  }
+};
+
+char MaterializeFunction::ID = 0;
+char ReleaseFunction::ID = 0;
+
+CodeGenOpt::Level getCodeGenOptLevel(unsigned OptLevel) {
+  switch (OptLevel) {
+  case 0:
+    return CodeGenOpt::None;
+  case 1:
+    return CodeGenOpt::Less;
+  case 3:
+    return CodeGenOpt::Aggressive;
+  default:
+    return CodeGenOpt::Default;
+  }
+}
+
+bool emitObjectFile(Module &M, TargetMachine &TM, SmallVectorImpl<char> &Obj,
+                    std::string &errMsg) {
+  legacy::PassManager PM;
+  raw_svector_ostream OS(Obj);
+  TargetLibraryInfoImpl TLII(llvm::Triple(M.getTargetTriple()));
+
+  PM.add(new TargetLibraryInfoWrapperPass(TLII));
+  PM.add(new MaterializeFunction());
+
+  // DisableVerify defaults to true. Each function is verified once it is
+  // materialized, before it is lowered.
+  if (TM.addPassesToEmitFile(PM, OS, TargetMachine::CGFT_ObjectFile,
+                             /*DisableVerify=*/false)) {
+    errMsg = "target does not support object file emission";
+    return false;
+  }
+
+  PM.add(new ReleaseFunction());
+  PM.run(M);
+
+  return true;
+}
+
+} // end unnamed namespace
+
+// NativeCodeGenerator -> Low Memory
+
+bool NativeCodeGenerator::parseModuleLazily() {
+  PhaseTimer Timer(Stats, PHASE_PARSE);
+
+  // Also finds the bitcode embedded into native object files.
+  auto BCData =
+      object::IRObjectFile::findBitcodeInMemBuffer(MemoryBufferRef(Data, Path));
+
+  if (std::error_code EC = BCData.getError()) {
+    errmsg(Path << ": " << EC.message());
+    return false;
+  }
+
+  auto M = getLazyBitcodeModule(MemoryBuffer::getMemBuffer(*BCData, false),
+                                *getContext());
+
+  if (std::error_code EC = M.getError()) {
+    errmsg(Path << ": " << EC.message());
+    return false;
+  }
+
+  LazyModule = std::move(M.get());
+
+  if (!Opts.Target.empty())
+    LazyModule->setTargetTriple(Opts.Target);
+
+  BCModule.TripleStr = LazyModule->getTargetTriple();
+
+  if (BCModule.TripleStr.empty())
+    return false;
+
+  BCModule.Triple = llvm::Triple(BCModule.TripleStr);
+  return true;
+}
+
+bool NativeCodeGenerator::setupTargetMachine() {
+  std::string errMsg;
+  const llvm::Target *T =
+      TargetRegistry::lookupTarget(BCModule.TripleStr, errMsg);
+
+  if (!T) {
+    errmsg(Path << ": " << errMsg);
+    return false;
+  }
+
+  parseLLVMOpts();
+
+  // Same mapping as LTOCodeGenerator::setCodePICModel().
+  Reloc::Model RelocModel = Reloc::Default;
+
+  if (usePICOpts()) {
+    if (Opts.PIC)
+      RelocModel = Reloc::PIC_;
+    if (Opts.PIE)
+      RelocModel = Reloc::Static;
+  }
+
+  std::string CPU = Opts.CPU;
+
+  if (CPU.empty())
+    CPU = getDefaultTargetCPU();
+
+  noteTarget(BCModule.TripleStr, CPU, Opts.Attrs);
+
+  TM.reset(T->createTargetMachine(BCModule.TripleStr, CPU, Opts.Attrs,
+                                  BCModule.TargetOpts, RelocModel,
+                                  CodeModel::Default,
+                                  getCodeGenOptLevel(Opts.OptLevel)));
+
+  if (!TM) {
+    errmsg(Path << ": cannot create target machine for "
+                << BCModule.TripleStr);
+    return false;
+  }
+
+  LazyModule->setDataLayout(*TM->getDataLayout());
+  return true;
+}
+
+bool NativeCodeGenerator::compileModuleLazily(std::string &errMsg) {
+  PhaseTimer Timer(Stats, PHASE_CODEGEN);
+  SmallVector<char, 0> Obj;
+
+  if (!emitObjectFile(*LazyModule, *TM, Obj, errMsg))
+    return false;
+
+  // Whatever is left of the IR.
+  LazyModule.reset();
+
+  code.CodeBuf =
+      MemoryBuffer::getMemBufferCopy(StringRef(Obj.data(), Obj.size()));
+  code.Code = code.CodeBuf->getBufferStart();
+  code.Length = code.CodeBuf->getBufferSize();
+
+  return true;
+}
+
+#else
+
+bool NativeCodeGenerator::parseModuleLazily() { return false; }
+bool NativeCodeGenerator::setupTargetMachine() { return false; }
+bool NativeCodeGenerator::compileModuleLazily(std::string &) { return false; }
+
+#endif
@@ -0,0 +1,276 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// -exports=<file> and -derive-exports: only the listed symbols, and the
+// ones that the inputs reference, are passed to addMustPreserveSymbol().
+// The LTO code generator internalizes all other definitions before it
+// optimizes, so that they can be inlined and dropped, or dead-stripped.
+//
+// The list has one symbol name (as nm prints it) or glob pattern ('*'
+// and '?') per line, '#' starts a comment.
+
+#include <set>
+
+#include "bc2obj.h"
+
+#include <llvm/Support/MD5.h>
+
+#if LLVM_VERSION_GE(3, 6)
+#include <llvm/Object/SymbolicFile.h>
+#endif
+
+namespace {
+
+bool Active;
+std::set<std::string> Names;
+std::vector<std::string> Patterns;
+std::set<std::string> Referenced; // -derive-exports
+std::string ExportsKey; // of everything, if a module can't be read
+
+bool matchGlob(StringRef Pattern, StringRef Name) {
+  size_t P = 0, N = 0;
+  size_t Star = StringRef::npos, Resume = 0;
+
+  while (N < Name.size()) {
+    if (P < Pattern.size() && (Pattern[P] == '?' || Pattern[P] == Name[N])) {
+      P++;
+      N++;
+    } else if (P < Pattern.size() && Pattern[P] == '*') {
+      Star = P++;
+      Resume = N;
+    } else if (Star != StringRef::npos) {
+      P = Star + 1;
+      N = ++Resume;
+    } else {
+      return false;
+    }
+  }
+
+  while (P < Pattern.size() && Pattern[P] == '*')
+    P++;
+
+  return P == Pattern.size();
+}
+
+bool readExportList(const std::string &Path, MD5 &Hash) {
+  auto Buf = MemoryBuffer::getFile(Path.c_str(), -1, false);
+
+  if (Buf.getError()) {
+    errmsg(Path << ": cannot open export list");
+    return false;
+  }
+
+  StringRef Data = Buf.get()->getBuffer();
+  Hash.update(Data);
+
+  while (!Data.empty()) {
+    StringRef Line;
+    std::tie(Line, Data) = Data.split('\n');
+    Line = Line.split('#').first.trim();
+
+    if (Line.empty())
+      continue;
+
+    if (Line.find_first_of("*?") != StringRef::npos)
+      Patterns.push_back(Line.str());
+    else
+      Names.insert(Line.str());
+  }
+
+  return true;
+}
+
+#if LLVM_VERSION_GE(3, 6)
+
+void addReferences(StringRef Data, StringRef Name) {
+  LLVMContext Context; // bitcode is only loaded lazily
+  MemoryBufferRef Buf(Data, Name);
+  auto Obj = object::SymbolicFile::createSymbolicFile(
+      Buf, sys::fs::file_magic::unknown, &Context);
+
+  if (Obj.getError())
+    return;
+
+  for (auto &Sym : (*Obj)->symbols()) {
+    if (!(Sym.getFlags() & object::BasicSymbolRef::SF_Undefined))
+      continue;
+
+    std::string SymName;
+    raw_string_ostream OS(SymName);
+
+    if (!Sym.printName(OS))
+      Referenced.insert(OS.str());
+  }
+}
+
+// The inputs are only mapped while they are scanned, workers of
+// -engine=prefork are forked afterwards.
+
+bool deriveExports(const std::vector<InputFile> &Inputs) {
+  for (auto &Input : Inputs) {
+    InputKind Kind = classifyFile(Input.Path);
+
+    if (Kind == INPUT_ARCHIVE || Kind == INPUT_THIN_ARCHIVE) {
+      bool OK;
+      BitCodeArchive Ar(Input.Path, OK);
+
+      if (!OK)
+        return false;
+
+      for (auto &Member : Ar.getMembers())
+        addReferences(Member.Data, Member.Name);
+
+      continue;
+    }
+
+    auto Buf = MemoryBuffer::getFile(Input.Path.c_str(), -1, false);
+
+    if (Buf.getError()) {
+      errmsg(Input.Path << ": cannot open file");
+      return false;
+    }
+
+    addReferences(Buf.get()->getBuffer(), Input.Path);
+  }
+
+  return true;
+}
+
+#endif
+
+} // end unnamed namespace
+
+bool initExports(const std::vector<InputFile> &Inputs) {
+  Active = false;
+  Names.clear();
+  Patterns.clear();
+  Referenced.clear();
+  ExportsKey.clear();
+
+  if (ExportList.empty() && !DeriveExports)
+    return true;
+
+  // Internalization is part of the optimization pipeline.
+  if (CodeGenOnly || LowMemory) {
+    errmsg("'-exports' and '-derive-exports' have no effect with "
+           "'-codegen-only' and '-low-memory'");
+    return true;
+  }
+
+  MD5 Hash;
+  MD5::MD5Result Result;
+  SmallString<32> Key;
+
+  if (!ExportList.empty() && !readExportList(ExportList, Hash))
+    return false;
+
+  if (DeriveExports) {
+#if LLVM_VERSION_GE(3, 6)
+    if (!deriveExports(Inputs))
+      return false;
+
+    msg("exporting " << Referenced.size() << " referenced symbol"
+                     << (Referenced.size() != 1 ? "s" : ""));
+
+    for (auto &Name : Referenced) {
+      Hash.update(Name);
+      Hash.update(StringRef("\0", 1));
+    }
+#else
+    (void)Inputs;
+    errmsg("'-derive-exports' requires LLVM 3.6 or later");
+    return false;
+#endif
+  }
+
+  Hash.final(Result);
+  MD5::stringifyResult(Result, Key);
+  ExportsKey = Key.c_str();
+
+  Active = true;
+  return true;
+}
+
+bool isExported(StringRef Name) {
+  if (!Active)
+    return true;
+
+  std::string Str = Name.str();
+
+  if (Names.count(Str) || Referenced.count(Str))
+    return true;
+
+  for (auto &Pattern : Patterns)
+    if (matchGlob(Pattern, Name))
+      return true;
+
+  return false;
+}
+
+// An object only depends on which of its own definitions are exported.
+// Keying it on the whole list, or on what all inputs reference, would
+// invalidate every object whenever any input changes.
+
+std::string getExportsKey(StringRef Data) {
+  if (!Active)
+    return std::string();
+
+#if LLVM_VERSION_GE(3, 6)
+  LLVMContext Context;
+  auto Obj = object::SymbolicFile::createSymbolicFile(
+      MemoryBufferRef(Data, ""), sys::fs::file_magic::unknown, &Context);
+
+  if (Obj.getError())
+    return ExportsKey;
+
+  std::set<std::string> Exported;
+
+  for (auto &Sym : (*Obj)->symbols()) {
+    if (Sym.getFlags() & object::BasicSymbolRef::SF_Undefined)
+      continue;
+
+    std::string SymName;
+    raw_string_ostream OS(SymName);
+
+    if (!Sym.printName(OS) && isExported(OS.str()))
+      Exported.insert(OS.str());
+  }
+
+  MD5 Hash;
+  MD5::MD5Result Result;
+  SmallString<32> Key;
+
+  Hash.update(StringRef("exports"));
+
+  for (auto &Name : Exported) {
+    Hash.update(StringRef("\0", 1));
+    Hash.update(Name);
+  }
+
+  Hash.final(Result);
+  MD5::stringifyResult(Result, Key);
+  return Key.c_str();
+#else
+  (void)Data;
+  return ExportsKey;
+#endif
+}
@@ -0,0 +1,139 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include "bc2obj.h"
+
+// The manifest is a text file next to the output archive. The first line
+// identifies the format, every other line describes one member of the
+// archive, in order: "<key> <member name>". Passed through native objects
+// have "-" as their key.
+
+namespace {
+const char *ManifestHeader = "bc2obj manifest 1";
+} // end unnamed namespace
+
+ArchiveManifest::ArchiveManifest(const std::string &ArchivePath)
+    : ArchivePath(ArchivePath) {
+  if (!load())
+    PreviousEntries.clear();
+}
+
+const BitCodeArchive::Member *
+ArchiveManifest::lookup(const std::string &Key, const std::string &Name) const {
+  auto I = PreviousEntries.find(getEntry(Key, Name));
+
+  if (I == PreviousEntries.end())
+    return nullptr;
+
+  return &Previous->getMembers()[I->second];
+}
+
+void ArchiveManifest::addMember(const std::string &Key,
+                                const std::string &Name) {
+  Entries.push_back(getEntry(Key, Name));
+}
+
+bool ArchiveManifest::write() const {
+  std::string Data = ManifestHeader;
+  Data += '\n';
+
+  for (auto &Entry : Entries) {
+    Data += Entry;
+    Data += '\n';
+  }
+
+  std::string Path = getPath(ArchivePath);
+
+  if (!writeFile(Path, Data.data(), Data.size())) {
+    errmsg(Path << ": cannot write manifest");
+    sys::fs::remove(Path);
+    return false;
+  }
+
+  return true;
+}
+
+std::string ArchiveManifest::getPath(const std::string &ArchivePath) {
+  return ArchivePath + ".manifest";
+}
+
+// ArchiveManifest -> Private
+
+std::string ArchiveManifest::getEntry(const std::string &Key,
+                                      const std::string &Name) {
+  return Key + ' ' + Name;
+}
+
+bool ArchiveManifest::load() {
+  std::string Path = getPath(ArchivePath);
+
+  if (!sys::fs::exists(Path) || !sys::fs::exists(ArchivePath))
+    return false;
+
+  auto Buf = MemoryBuffer::getFile(Path.c_str(), -1, false);
+
+  if (Buf.getError())
+    return false;
+
+  bool OK;
+  Previous.reset(new BitCodeArchive(ArchivePath, OK));
+
+  if (!OK)
+    return false;
+
+  const auto &Members = Previous->getMembers();
+  StringRef Data = Buf.get()->getBuffer();
+  StringRef Line;
+  size_t Index = 0;
+
+  std::tie(Line, Data) = Data.split('\n');
+
+  if (Line != ManifestHeader) {
+    msg(Path << ": unknown manifest format, regenerating all members");
+    return false;
+  }
+
+  while (!Data.empty()) {
+    std::tie(Line, Data) = Data.split('\n');
+
+    StringRef Key, Name;
+    std::tie(Key, Name) = Line.split(' ');
+
+    // The archive must have been written along with the manifest.
+    if (Index >= Members.size() || Members[Index].Name != Name) {
+      msg(Path << ": stale manifest, regenerating all members");
+      return false;
+    }
+
+    if (Key != "-")
+      PreviousEntries[Line.str()] = Index;
+
+    Index++;
+  }
+
+  if (Index != Members.size()) {
+    msg(Path << ": stale manifest, regenerating all members");
+    return false;
+  }
+
+  return true;
+}
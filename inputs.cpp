@@ -0,0 +1,244 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// Inputs are given on the command line (or in response files, which
+// cl::ParseCommandLineOptions() expands) and in input lists (-inputs).
+// An input list has one input per line:
+//
+//   <input> [-o <output>] [-target=<triple>] [-cpu=<cpu>] [-attrs=<attrs>]
+//           [-O<level>] [-pic] [-pie] [-generate-debug-symbols]
+//
+// Fields are separated by white space and can be quoted with "", lines
+// starting with '#' are comments. Relative paths are relative to the
+// current directory. A directory is searched recursively for inputs, its
+// layout is mirrored under -out-dir (or -o).
+
+#include <cctype>
+#include <llvm/Support/Path.h>
+
+#include "bc2obj.h"
+
+namespace {
+
+bool splitFields(StringRef Line, std::vector<std::string> &Fields) {
+  std::string Field;
+  bool InField = false;
+  bool Quoted = false;
+
+  for (size_t I = 0; I < Line.size(); ++I) {
+    char C = Line[I];
+
+    if (C == '"') {
+      Quoted = !Quoted;
+      InField = true;
+    } else if (C == '\\' && Quoted && I + 1 < Line.size()) {
+      Field += Line[++I];
+    } else if (!Quoted && isspace(static_cast<unsigned char>(C))) {
+      if (InField)
+        Fields.push_back(std::move(Field));
+      Field.clear();
+      InField = false;
+    } else {
+      Field += C;
+      InField = true;
+    }
+  }
+
+  if (InField)
+    Fields.push_back(std::move(Field));
+
+  return !Quoted;
+}
+
+std::string getOutputPath(const std::string &Path) {
+  std::string OutPath = OutDir;
+  OutPath += PATH_DIV;
+  OutPath += getFileName(Path.c_str());
+  return OutPath;
+}
+
+// Adds every input below Dir. The outputs go to the same relative path
+// below OutRoot.
+
+bool addDirectory(const InputFile &Root, const std::string &OutRoot,
+                  std::vector<InputFile> &Inputs) {
+  std::error_code EC;
+  size_t NumInputs = Inputs.size();
+
+  for (sys::fs::recursive_directory_iterator I(Root.Path, EC), E;
+       I != E && !EC; I.increment(EC)) {
+    const std::string &Path = I->path();
+    StringRef Name = sys::path::filename(Path);
+    bool isFile;
+
+    if (Name.startswith(".")) {
+      I.no_push(); // i.e. .git
+      continue;
+    }
+
+    if (sys::fs::is_regular_file(Path, isFile) || !isFile ||
+        classifyFile(Path) == INPUT_UNKNOWN)
+      continue;
+
+    StringRef RelPath = StringRef(Path).substr(Root.Path.size());
+
+    InputFile Input = Root;
+    Input.Path = Path;
+    Input.OutPath = OutRoot;
+    Input.OutPath += PATH_DIV;
+    Input.OutPath += RelPath.ltrim("/\\").str();
+    Inputs.push_back(std::move(Input));
+  }
+
+  if (EC) {
+    errmsg(Root.Path << ": " << EC.message());
+    return false;
+  }
+
+  msg("found " << Inputs.size() - NumInputs << " inputs in " << Root.Path);
+  return true;
+}
+
+bool addInput(InputFile &Input, const std::string &OutPath,
+              std::vector<InputFile> &Inputs) {
+  bool isDirectory;
+
+  if (!sys::fs::is_directory(Input.Path, isDirectory) && isDirectory)
+    return addDirectory(Input, OutPath.empty() ? OutDir : OutPath, Inputs);
+
+  bool isFile;
+
+  if (sys::fs::is_regular_file(Input.Path, isFile) || !isFile) {
+    errmsg(Input.Path << ": is not a file");
+    return false;
+  }
+
+  Input.OutPath = OutPath.empty() ? getOutputPath(Input.Path) : OutPath;
+  Inputs.push_back(std::move(Input));
+  return true;
+}
+
+bool readInputList(const std::string &List, std::vector<InputFile> &Inputs) {
+  auto Buf = MemoryBuffer::getFile(List.c_str(), -1, false);
+
+  if (Buf.getError()) {
+    errmsg(List << ": cannot open input list");
+    return false;
+  }
+
+  StringRef Data = Buf.get()->getBuffer();
+  StringRef Line;
+  std::vector<std::string> Fields;
+
+  for (unsigned LineNo = 1; !Data.empty(); ++LineNo) {
+    std::tie(Line, Data) = Data.split('\n');
+    Line = Line.trim();
+
+    if (Line.empty() || Line[0] == '#')
+      continue;
+
+    Fields.clear();
+
+    if (!splitFields(Line, Fields)) {
+      errmsg(List << ":" << LineNo << ": unterminated quote");
+      return false;
+    }
+
+    InputFile Input;
+    std::string OutPath;
+    Input.Path = Fields[0];
+
+    for (size_t I = 1; I < Fields.size(); ++I) {
+      if (Fields[I] == "-o" && I + 1 < Fields.size()) {
+        OutPath = Fields[++I];
+      } else if (!Input.Opts.parse(Fields[I])) {
+        errmsg(List << ":" << LineNo << ": unsupported option: " << Fields[I]);
+        return false;
+      }
+    }
+
+    if (!addInput(Input, OutPath, Inputs))
+      return false;
+  }
+
+  return true;
+}
+
+} // end unnamed namespace
+
+CodeGenOptions::CodeGenOptions()
+    : Target(::Target), CPU(::CPU), Attrs(::Attrs),
+#if LLVM_VERSION_GE(3, 7)
+      OptLevel(::OptLevel),
+#else
+      OptLevel(2), // -O requires LLVM 3.7
+#endif
+      PIC(::PIC), PIE(::PIE), GenerateDebugSymbols(::GenerateDebugSymbols) {}
+
+bool CodeGenOptions::parse(StringRef Opt) {
+  StringRef Name, Val;
+  std::tie(Name, Val) = Opt.split('=');
+
+  if (Name == "-target")
+    Target = Val.str();
+  else if (Name == "-cpu")
+    CPU = Val.str();
+  else if (Name == "-attrs")
+    Attrs = Val.str();
+  else if (Opt == "-pic")
+    PIC = true;
+  else if (Opt == "-pie")
+    PIE = true;
+  else if (Opt == "-generate-debug-symbols")
+    GenerateDebugSymbols = true;
+#if LLVM_VERSION_GE(3, 7)
+  else if (Opt.startswith("-O"))
+    return !Opt.substr(2).ltrim("=").getAsInteger(10, OptLevel) &&
+           OptLevel <= 3;
+#endif
+  else
+    return false;
+
+  return true;
+}
+
+bool collectInputs(std::vector<InputFile> &Inputs) {
+  for (auto &BitCodeFile : BitCodeFiles) {
+    if (!BitCodeFile.empty() && BitCodeFile[0] == '-') {
+      errmsg("unknown option: " << BitCodeFile);
+      return false;
+    }
+
+    InputFile Input;
+    Input.Path = BitCodeFile;
+
+    if (!addInput(Input, "", Inputs))
+      return false;
+  }
+
+  for (auto &List : InputLists) {
+    if (!readInputList(List, Inputs))
+      return false;
+  }
+
+  return true;
+}
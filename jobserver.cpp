@@ -0,0 +1,185 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#endif /* _WIN32 */
+
+#include "jobserver.h"
+
+namespace {
+
+int ReadFD = -1;
+int WriteFD = -1;
+std::vector<char> Tokens;
+
+#ifndef _WIN32
+bool isValidFD(int FD) { return FD >= 0 && fcntl(FD, F_GETFD) != -1; }
+
+bool openFifo(const std::string &Path) {
+  ReadFD = open(Path.c_str(), O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+  WriteFD = open(Path.c_str(), O_WRONLY | O_CLOEXEC);
+
+  if (ReadFD == -1 || WriteFD == -1) {
+    if (ReadFD != -1)
+      close(ReadFD);
+    if (WriteFD != -1)
+      close(WriteFD);
+    ReadFD = WriteFD = -1;
+    return false;
+  }
+
+  return true;
+}
+
+bool openPipe(int R, int W) {
+  if (!isValidFD(R) || !isValidFD(W))
+    return false;
+
+  // The pipe is shared with make and every other client, reopen it through
+  // /proc to get a private non-blocking file description for reading.
+  char Path[64];
+  snprintf(Path, sizeof(Path), "/proc/self/fd/%d", R);
+  int FD = open(Path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+
+  // Reading from the shared, blocking descriptor could block forever
+  // once another client has taken the token that poll() has seen, and
+  // making it non-blocking would change it for make as well. Go without
+  // the jobserver then, -j still limits the jobs.
+  if (FD == -1)
+    return false;
+
+  ReadFD = FD;
+  WriteFD = W;
+  return true;
+}
+#endif /* _WIN32 */
+
+} // end unnamed namespace
+
+// Looks for a GNU make jobserver in MAKEFLAGS, which is either
+// --jobserver-auth=R,W / --jobserver-fds=R,W (pipe) or
+// --jobserver-auth=fifo:PATH (make 4.4+).
+
+bool initJobServer() {
+#ifndef _WIN32
+  const char *MakeFlags = getenv("MAKEFLAGS");
+
+  if (!MakeFlags)
+    return false;
+
+  std::string Auth;
+  std::string Flags = MakeFlags;
+  size_t Pos = 0;
+
+  while (Pos < Flags.size()) {
+    size_t End = Flags.find(' ', Pos);
+
+    if (End == std::string::npos)
+      End = Flags.size();
+
+    std::string Flag = Flags.substr(Pos, End - Pos);
+
+    // The last one wins.
+    for (const char *Prefix : {"--jobserver-auth=", "--jobserver-fds="}) {
+      size_t Len = strlen(Prefix);
+      if (!Flag.compare(0, Len, Prefix))
+        Auth = Flag.substr(Len);
+    }
+
+    Pos = End + 1;
+  }
+
+  if (Auth.empty())
+    return false;
+
+  if (!Auth.compare(0, 5, "fifo:"))
+    return openFifo(Auth.substr(5));
+
+  int R, W;
+
+  if (sscanf(Auth.c_str(), "%d,%d", &R, &W) != 2)
+    return false;
+
+  return openPipe(R, W);
+#else
+  return false;
+#endif /* _WIN32 */
+}
+
+bool isJobServerActive() { return ReadFD != -1; }
+
+// Tries to get a token for up to Timeout milliseconds.
+
+bool acquireJobToken(int Timeout) {
+#ifndef _WIN32
+  struct pollfd PFD;
+  PFD.fd = ReadFD;
+  PFD.events = POLLIN;
+
+  if (poll(&PFD, 1, Timeout) <= 0)
+    return false;
+
+  char Token;
+  ssize_t Len = read(ReadFD, &Token, 1);
+
+  if (Len != 1) {
+    // Somebody else got it first.
+    if (Len == -1 && (errno == EAGAIN || errno == EINTR))
+      return false;
+
+    // make went away, don't wait for tokens anymore.
+    close(ReadFD);
+    ReadFD = -1;
+    return false;
+  }
+
+  Tokens.push_back(Token);
+  return true;
+#else
+  (void)Timeout;
+  return false;
+#endif /* _WIN32 */
+}
+
+void releaseJobToken() {
+#ifndef _WIN32
+  if (Tokens.empty())
+    return;
+
+  char Token = Tokens.back();
+
+  while (write(WriteFD, &Token, 1) == -1 && errno == EINTR)
+    ;
+
+  Tokens.pop_back();
+#endif /* _WIN32 */
+}
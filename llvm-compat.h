@@ -45,22 +45,9 @@
 #endif
 
 #if LLVM_VERSION_LT(3, 6)
-#define compile_to_file(name, disableOpt, disableInline, disableGVNLoadPRE,    \
-                        disableVectorization, errMsg)                          \
-  compile_to_file(name, disableOpt, disableInline, disableGVNLoadPRE, errMsg)
-
 #define compile(length, disableOpt, disableInline, disableGVNLoadPRE,          \
                 disableVectorization, errMsg)                                  \
   compile(length, disableOpt, disableInline, disableGVNLoadPRE, errMsg)
-#elif LLVM_VERSION_GE(3, 7)
-#define compile_to_file(name, disableOpt, disableInline, disableGVNLoadPRE,    \
-                        disableVectorization, errMsg)                          \
-  compile_to_file(name, disableInline, disableGVNLoadPRE,                      \
-                  disableVectorization, errMsg)
-
-#define compile(length, disableOpt, disableInline, disableGVNLoadPRE,          \
-                disableVectorization, errMsg)                                  \
-  compile(disableInline, disableGVNLoadPRE, disableVectorization, errMsg)
 #endif
 
 #if LLVM_VERSION_GE(3, 6)
@@ -20,6 +20,12 @@
   THE SOFTWARE.
  */
 
+#include <algorithm>
+#include <chrono>
+#include <set>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/Path.h>
+
 #include "bc2obj.h"
 
 cl::opt<bool> GenerateDebugSymbols("generate-debug-symbols",
@@ -32,6 +38,16 @@ cl::opt<bool> DisableOptimizations("disable-optimizations",
                                    cl::init(false));
 #endif
 
+cl::opt<bool> CodeGenOnly("codegen-only",
+                          cl::desc("skip the LTO optimization pipeline, for "
+                                   "already optimized bitcode"),
+                          cl::init(false));
+
+cl::opt<bool> LowMemory("low-memory",
+                        cl::desc("load function bodies lazily and free their "
+                                 "IR once emitted (implies -codegen-only)"),
+                        cl::init(false));
+
 cl::opt<bool> DisableInlinePass("disable-inline-pass",
                                 cl::desc("disable inline pass"),
                                 cl::init(false));
@@ -66,10 +82,17 @@ cl::opt<std::string> CPU("cpu", cl::desc("cpu to generate code for"));
 
 cl::opt<std::string> Attrs("attrs", cl::desc("codegen attrs (+sse, ...)"));
 
-cl::opt<std::string> AR("ar", cl::desc("archiver to use (default: llvm-ar)"),
+cl::opt<std::string> AR("ar", cl::desc("external archiver to use instead of "
+                                 "the built-in archive writer"),
                         cl::init("llvm-ar"));
 
-cl::list<std::string> BitCodeFiles(cl::Sink, cl::OneOrMore);
+cl::list<std::string> BitCodeFiles(cl::Sink, cl::ZeroOrMore);
+
+cl::list<std::string> InputLists("inputs",
+                                 cl::desc("read inputs from <file>, one per "
+                                          "line: <input> [-o <output>] "
+                                          "[options]"),
+                                 cl::value_desc("file"), cl::ZeroOrMore);
 
 cl::opt<std::string> OutDir("out-dir", cl::desc("output directory"),
                             cl::init("native"));
@@ -77,26 +100,116 @@ cl::opt<std::string> OutDir("out-dir", cl::desc("output directory"),
 cl::opt<int> NumJobs("j", cl::desc("jobs"), cl::init(getCPUCount()),
                      cl::Prefix);
 
-namespace {
+cl::opt<std::string>
+    MaxMemory("max-memory",
+              cl::desc("hold jobs back while their estimated memory use "
+                       "would exceed <size> (K, M, G or T suffix, "
+                       "default: M)"),
+              cl::value_desc("size"));
+
+cl::opt<ExecutionEngine>
+    Engine("engine", cl::desc("execution engine (default: fork)"),
+           cl::values(clEnumValN(FORK_ENGINE, "fork",
+                                 "fork a process per module (crash isolation)"),
+                      clEnumValN(THREAD_ENGINE, "thread",
+                                 "run modules in an in-process thread pool"),
+                      clEnumValN(PREFORK_ENGINE, "prefork",
+                                 "reuse <j> worker processes forked up "
+                                 "front"),
+                      clEnumValEnd),
+           cl::init(FORK_ENGINE));
+
+cl::opt<bool> NUMA("numa",
+                   cl::desc("pin jobs to NUMA nodes and keep their memory "
+                            "local to the node (Linux only)"),
+                   cl::init(false));
+
+cl::opt<bool> LinkNative("link-native",
+                         cl::desc("hard link native object files into the "
+                                  "output directory instead of copying them"),
+                         cl::init(false));
+
+cl::opt<std::string> TimeReport("time-report",
+                                cl::desc("write a JSON report with per-module "
+                                         "phase timings to <file>"),
+                                cl::value_desc("file"));
+
+cl::opt<bool> PerfCounters("perf-counters",
+                           cl::desc("add hardware performance counters per "
+                                    "phase to the '-time-report'"),
+                           cl::init(false));
+
+cl::opt<unsigned>
+    SplitCodeGen("split-codegen",
+                 cl::desc("split each module into up to <N> partitions and "
+                          "generate code for them in parallel"),
+                 cl::value_desc("N"), cl::init(1));
+
+cl::list<std::string>
+    VariantSpecs("variant",
+                 cl::desc("generate code for <name>:<triple>:<cpu>:<attrs> "
+                          "into <out-dir>/<name> (empty fields keep the "
+                          "options of the input)"),
+                 cl::value_desc("spec"), cl::ZeroOrMore);
+
+cl::opt<std::string> LD("ld", cl::desc("linker used to merge the partitions "
+                                       "of '-split-codegen' (default: "
+                                       "<triple>-ld or ld)"));
+
+cl::opt<bool> ThinLTO("thin-lto",
+                      cl::desc("import small functions across the members "
+                               "of bitcode archives"),
+                      cl::init(false));
+
+cl::opt<unsigned>
+    ImportLimit("import-limit",
+                cl::desc("largest function (in instructions) that "
+                         "'-thin-lto' imports"),
+                cl::init(100));
+
+cl::opt<std::string> CacheDir("cache-dir",
+                              cl::desc("object cache directory"));
+
+cl::opt<unsigned> CacheSize("cache-size",
+                            cl::desc("object cache size limit in MiB "
+                                     "(default: 1024)"),
+                            cl::init(1024));
+
+cl::opt<bool> Incremental("incremental",
+                          cl::desc("only regenerate the archive members that "
+                                   "changed since the previous run"),
+                          cl::init(false));
+
+cl::opt<std::string> Profile("profile",
+                             cl::desc("optimize with the sample profile "
+                                      "<file> (needs line tables)"),
+                             cl::value_desc("file"));
+
+cl::opt<std::string> ExportList("exports",
+                                cl::desc("internalize all symbols but those "
+                                         "listed (names or globs) in <file>"),
+                                cl::value_desc("file"));
+
+cl::opt<bool> DeriveExports("derive-exports",
+                            cl::desc("internalize all symbols that no "
+                                     "input references (and -exports "
+                                     "doesn't list)"),
+                            cl::init(false));
+
+cl::opt<std::string> Server("server",
+                            cl::desc("serve bc2obj-client on the Unix "
+                                     "socket <path>"),
+                            cl::value_desc("path"));
 
-bool isArchive(const char *Path) {
-  // FIXME: check header
-  const char *Ext = std::strrchr(Path, '.');
-  if (!Ext)
-    return false;
-  return !std::strcmp(Ext, ".a");
-}
+namespace {
 
-bool createArchive(const char *ArchiveName,
+bool createArchive(const std::string &OutputFile,
                    const std::vector<std::string> &Files) {
   bool OK;
 
-  if (!forkProcess(true, &OK)) {
-    std::string OutputFile = OutDir;
-    OutputFile += PATH_DIV;
-    OutputFile += ArchiveName;
+  msg("generating archive: " << OutputFile);
 
-    msg("generating archive: " << OutputFile);
+  if (!forkProcess(true, &OK)) {
     std::string Program = sys::FindProgramByName(AR);
 
     if (Program.empty()) {
@@ -131,158 +244,763 @@ bool createArchive(const char *ArchiveName,
   return OK;
 }
 
-bool createNativeArchive(const std::string &File) {
+struct NativeMember {
+  std::string Name;
+  std::string File; // written by a forked child
+  NativeCodeGenerator::Code Code; // or handed back in memory
+  bool Passthrough = false;
+  int SourceFD = -1; // of a passthrough member
+  uint64_t SourceOffset = 0;
+  int ObjectFD = -1; // the object goes back through, until the job is done
+};
+
+struct NativeArchive {
+  std::string Path;
+  std::string OutPath;
+  std::shared_ptr<BitCodeArchive> BCAr; // shared by the -variant archives
+  std::unique_ptr<ThinLTOIndex> ThinIndex; // with -thin-lto
+  std::unique_ptr<ArchiveManifest> Manifest; // with -incremental
+  std::string Dir; // for objects that have to go through the disk
+  std::deque<NativeMember> Members;
+  std::vector<std::string> Files;
+  size_t PendingJobs = 0;
+  bool OK = true;
+  bool Finished = false;
+};
+
+struct Job {
+  uint64_t Cost;
+  unsigned Slots = 1; // threads it runs
+  std::function<bool()> Run;
+  std::vector<NativeArchive *> Archives; // one per -variant
+  size_t Index; // into the time report
+  std::unique_ptr<WorkerJob> Work; // the same job, for -engine=prefork
+  std::vector<NativeMember *> Objects; // handed back through object FDs
+};
+
+// The variants of a module are generated instead of its partitions.
+unsigned getCodeGenSlots() {
+  return getVariants().empty() ? getSplitSlots() : getVariantSlots();
+}
+
+bool useExternalArchiver() { return AR.getNumOccurrences() > 0; }
+
+// Threads hand the objects back in memory, unless an external
+// archiver has been requested.
+bool keepObjectsInMemory() {
+  return Engine == THREAD_ENGINE && !useExternalArchiver();
+}
+
+// Forked jobs hand them back through shared memory files, if possible.
+bool useObjectTransport() {
+  return Engine != THREAD_ENGINE && !useExternalArchiver() &&
+         hasObjectTransport();
+}
+
+bool writeNativeArchive(const std::string &OutputFile,
+                        std::deque<NativeMember> &NativeMembers) {
+  msg("generating archive: " << OutputFile);
+
+  std::vector<ArchiveMember> Members(NativeMembers.size());
+  std::vector<std::unique_ptr<MemoryBuffer>> Bufs;
+
+  for (size_t I = 0; I < NativeMembers.size(); ++I) {
+    NativeMember &NativeMember = NativeMembers[I];
+    ArchiveMember &Member = Members[I];
+    Member.Name = NativeMember.Name;
+
+    if (NativeMember.File.empty()) {
+      auto &Code = NativeMember.Code;
+      Member.Data = StringRef(static_cast<const char *>(Code.Code), Code.Length);
+      Member.Symbols = std::move(Code.Symbols);
+
+      if (NativeMember.Passthrough) {
+        Member.SourceFD = NativeMember.SourceFD;
+        Member.SourceOffset = NativeMember.SourceOffset;
+      }
+
+      continue;
+    }
+
+    auto Buf = MemoryBuffer::getFile(NativeMember.File.c_str(), -1, false);
+
+    if (Buf.getError()) {
+      errmsg(NativeMember.File << ": cannot open file");
+      return false;
+    }
+
+    Bufs.push_back(moveMemBuffer(Buf.get()));
+    Member.Data = Bufs.back()->getBuffer();
+  }
+
+  return writeArchive(OutputFile, Members);
+}
+
+// Called as soon as the last member job of an archive is done,
+// independent of the jobs of other inputs.
+
+bool finishNativeArchive(NativeArchive &Ar) {
+  bool OK = Ar.OK;
+  Ar.Finished = true;
+
+  if (OK) {
+    // A manifest must never describe another archive than the one next
+    // to it, not even if this run isn't incremental.
+    sys::fs::remove(ArchiveManifest::getPath(Ar.OutPath));
+
+    if (useExternalArchiver())
+      OK = createArchive(Ar.OutPath, Ar.Files);
+    else
+      OK = writeNativeArchive(Ar.OutPath, Ar.Members);
+
+    if (OK && Ar.Manifest)
+      OK = Ar.Manifest->write();
+  }
+
+  if (!Ar.Dir.empty()) {
+    Ar.Files.push_back(Ar.Dir);
+
+    for (auto &File : Ar.Files) {
+      if (sys::fs::remove(File.c_str())) {
+        errmsg(File << ": cannot remove file");
+        OK = false;
+      }
+    }
+  }
+
+  // Release the mapped input archive and the generated objects.
+  for (auto &Member : Ar.Members)
+    if (Member.ObjectFD != -1)
+      close(Member.ObjectFD);
+
+  Ar.Members.clear();
+  Ar.ThinIndex.reset();
+  Ar.Manifest.reset();
+  Ar.BCAr.reset();
+
+  return OK;
+}
+
+bool addNativeArchive(const InputFile &Input,
+                      std::deque<NativeArchive> &Archives,
+                      std::vector<Job> &Jobs,
+                      std::vector<ReportEntry> &Entries) {
+  const std::string &File = Input.Path;
+  const CodeGenOptions *Opts = &Input.Opts;
+  const auto &Variants = getVariants();
   bool OK;
-  bool isNativeObjectFile;
-  BitCodeArchive BCAr(File, OK);
-  const object::Archive &Archive = BCAr.getArchive();
+
+  // One output archive per -variant, all of them fed by the same jobs.
+  std::shared_ptr<BitCodeArchive> BCAr(new BitCodeArchive(File, OK));
+  std::vector<NativeArchive *> Ars;
 
   if (!OK)
     return false;
 
-  SmallVector<char, 32> tmp;
+  bool InMemory = keepObjectsInMemory();
+  bool Transport = useObjectTransport();
+  size_t NumOutputs = std::max<size_t>(Variants.size(), 1);
 
-  if (sys::fs::createUniqueDirectory("", tmp)) {
-    errmsg("cannot create temporary directory");
-    return false;
+  for (size_t V = 0; V < NumOutputs; ++V) {
+    Archives.emplace_back();
+    NativeArchive &Ar = Archives.back();
+    Ar.Path = File;
+    Ar.OutPath =
+        Variants.empty() ? Input.OutPath : getVariantPath(Input.OutPath, V);
+    Ar.BCAr = BCAr;
+
+    if (!InMemory && !Transport) {
+      SmallVector<char, 32> tmp;
+
+      if (sys::fs::createUniqueDirectory("", tmp)) {
+        errmsg("cannot create temporary directory");
+        return false;
+      }
+
+      Ar.Dir = &tmp[0];
+    }
+
+    if (Incremental)
+      Ar.Manifest.reset(new ArchiveManifest(Ar.OutPath));
+
+    Ars.push_back(&Ar);
   }
 
-  std::vector<std::string> Files;
-  std::string Path;
+  if (ThinLTO) {
+    msg("building module summaries for " << File);
+    Ars[0]->ThinIndex.reset(new ThinLTOIndex);
+  }
+
+  const ThinLTOIndex *ThinIndex = Ars[0]->ThinIndex.get();
+  std::vector<const BitCodeArchive::Member *> Reused(NumOutputs);
   std::string ObjName;
+  size_t NumReused = 0;
 
-  for (auto Obj = Archive.child_begin(); Obj != Archive.child_end(); ++Obj) {
-    auto Buf = Obj->getBuffer();
-    ObjName = BitCodeArchive::getObjName(Obj);
-    
-#if LLVM_VERSION_GE(3, 7)
-    OK = !Buf.getError();
-    llvm::StringRef StrBuf = *Buf;
-#else
-    llvm::StringRef &StrBuf = Buf;
-#endif
+  for (auto &ArMember : BCAr->getMembers()) {
+    StringRef StrBuf = ArMember.Data;
+    ObjName = ArMember.Name;
 
-    Path = &tmp[0];
-    Path += PATH_DIV;
-    Path += ObjName;
+    for (auto *Ar : Ars) {
+      Ar->Members.emplace_back();
+      Ar->Members.back().Name = ObjName;
+    }
 
-    if (OK)
-      OK = waitForJob();
+    // Native objects (without embedded bitcode) are passed through.
+    bool Passthrough = classifyInput(StrBuf) == INPUT_NATIVE_OBJECT;
+    bool AllReused = false;
 
-    if (!OK)
-      break;
+    if (Incremental) {
+      std::string Key = Passthrough ? "-" : getObjectCacheKey(StrBuf, *Opts);
 
-    msg("codegen'ing " << File << "(" << ObjName << ") to " << Path);
+      // A member is only taken over if it is unchanged in every variant,
+      // they are generated by the same job.
+      AllReused = !Passthrough;
+
+      for (size_t V = 0; V < NumOutputs; ++V) {
+        std::string VariantKey = Key;
+
+        if (!Variants.empty() && !Passthrough)
+          VariantKey += "-" + Variants[V].Key;
+
+        auto *Manifest = Ars[V]->Manifest.get();
+        Reused[V] = Passthrough ? nullptr : Manifest->lookup(VariantKey,
+                                                             ObjName);
+        AllReused &= !!Reused[V];
+        Manifest->addMember(VariantKey, ObjName);
+      }
+
+      if (AllReused)
+        NumReused++;
+    }
+
+    size_t Index = Entries.size();
+    Entries.push_back(
+        {File + "(" + ObjName + ")", StrBuf.size(), Passthrough, AllReused});
+
+    std::vector<std::string> Paths(NumOutputs);
+
+    if (!InMemory && !Transport) {
+      for (size_t V = 0; V < NumOutputs; ++V) {
+        Paths[V] = Ars[V]->Dir;
+        Paths[V] += PATH_DIV;
+        Paths[V] += ObjName;
+      }
+    }
+
+    if (Passthrough || AllReused) {
+      for (size_t V = 0; V < NumOutputs; ++V) {
+        const BitCodeArchive::Member &Source =
+            AllReused ? *Reused[V] : ArMember;
+        NativeMember &Member = Ars[V]->Members.back();
+
+        // Streamed from the input (or the previous output) archive, unless
+        // an external archiver needs it on disk.
+        if (useExternalArchiver()) {
+          if (!writeFile(Paths[V], Source.Data.data(), Source.Data.size()))
+            return false;
+          Member.File = Paths[V];
+          Ars[V]->Files.push_back(std::move(Paths[V]));
+        } else {
+          Member.Code.Code = Source.Data.data();
+          Member.Code.Length = Source.Data.size();
+          Member.Passthrough = true;
+          Member.SourceFD = Source.SourceFD;
+          Member.SourceOffset = Source.SourceOffset;
+        }
+      }
+      continue;
+    }
 
-    if (!forkProcess(false)) {
-      NativeCodeGenerator NCodeGen(ObjName, StrBuf, OK, isNativeObjectFile);
+    std::vector<NativeCodeGenerator::Code *> Results;
+    std::vector<NativeMember *> Objects;
+    size_t Module = 0;
 
+    if (ThinIndex) {
+      Module = Ars[0]->ThinIndex->addSummary(ObjName, StrBuf, OK);
       if (!OK)
         return false;
+    }
+
+    for (size_t V = 0; V < NumOutputs; ++V) {
+      NativeMember &Member = Ars[V]->Members.back();
+
+      if (InMemory) {
+        Results.push_back(&Member.Code);
+      } else if (Transport) {
+        Objects.push_back(&Member);
+      } else {
+        Member.File = Paths[V];
+        Ars[V]->Files.push_back(Paths[V]);
+      }
+    }
+
+    Job NewJob;
+    NewJob.Cost = StrBuf.size();
+    NewJob.Slots = getCodeGenSlots();
+    NewJob.Archives = Ars;
+    NewJob.Index = Index;
+    NewJob.Objects = Objects;
+    NewJob.Run = [File, ObjName, StrBuf, Paths, Results, Objects, Index,
+                  ThinIndex, Module, Opts] {
+      JobStats *Stats = getJobStats(Index);
+      std::string Bitcode; // with the imported functions
+      StringRef Data = StrBuf;
+
+      if (ThinIndex) {
+        PhaseTimer Timer(Stats, PHASE_PARSE);
+
+        if (!ThinIndex->importFunctions(Module, Bitcode)) {
+          finishJobStats(Stats);
+          return false;
+        }
+
+        if (!Bitcode.empty())
+          Data = Bitcode;
+      }
+
+      NativeCodeGenerator NCodeGen(ObjName, Data);
+      NCodeGen.setOptions(*Opts);
+
+      if (Paths[0].empty())
+        msg("codegen'ing " << File << "(" << ObjName << ")");
+      else
+        msg("codegen'ing " << File << "(" << ObjName << ") to " << Paths[0]);
+
+      NCodeGen.setJobStats(Stats);
+      bool OK = NCodeGen.generateNativeCodeMemory();
 
-      bool OK = NCodeGen.generateNativeCodeMemory() &&
-                NCodeGen.writeCodeToDisk(&tmp[0]);
-      ONUNIX(NCodeGen.~NativeCodeGenerator());
+      if (OK) {
+        PhaseTimer Timer(Stats, PHASE_WRITE);
+        bool Variants = !getVariants().empty();
+
+        for (size_t V = 0; V < Paths.size() && OK; ++V) {
+          if (!Results.empty())
+            *Results[V] = Variants ? NCodeGen.takeCode(V) : NCodeGen.takeCode();
+          else if (!Objects.empty())
+            OK = Variants ? NCodeGen.writeCodeToFD(Objects[V]->ObjectFD, V)
+                          : NCodeGen.writeCodeToFD(Objects[V]->ObjectFD);
+          else
+            OK = Variants ? NCodeGen.writeCodeToFile(Paths[V], V)
+                          : NCodeGen.writeCodeToFile(Paths[V]);
+        }
+      }
 
-      childExit(!OK);
+      finishJobStats(Stats);
+      return OK;
+    };
+
+    if (Engine == PREFORK_ENGINE) {
+      NewJob.Work.reset(new WorkerJob);
+      NewJob.Work->Path = ArMember.SourcePath;
+      NewJob.Work->Archive = File;
+      NewJob.Work->Name = ObjName;
+      NewJob.Work->Offset = ArMember.SourceOffset;
+      NewJob.Work->Size = StrBuf.size();
+      NewJob.Work->OutPaths = Paths;
+      NewJob.Work->Opts = *Opts;
+      NewJob.Work->Index = Index;
     }
 
-    ActiveJobs++;
-    Files.push_back(std::move(Path));
+    Jobs.push_back(std::move(NewJob));
+
+    for (auto *Ar : Ars)
+      Ar->PendingJobs++;
   }
 
-  bool V = waitForJobs();
+  if (Incremental)
+    errmsg(Ars[0]->OutPath << ": reusing " << NumReused << " unchanged member"
+                           << (NumReused != 1 ? "s" : ""));
 
-  if (OK)
-    OK = V;
+  return true;
+}
 
-  if (OK)
-    OK = createArchive(getFileName(File.c_str()), Files);
+// The jobs of addNativeArchive() and convert(), in a worker of
+// -engine=prefork. Members go back through their object FDs, or through
+// the disk.
 
-  Files.push_back(&tmp[0]);
+// Copies a native object input to its output path of every -variant.
 
-  for (auto &File : Files) {
-    if (sys::fs::remove(File.c_str())) {
-      errmsg(File << ": cannot remove file");
-      OK = false;
+bool passthroughFiles(const std::string &Path,
+                      const std::vector<std::string> &OutPaths) {
+  for (auto &OutPath : OutPaths) {
+    msg("copying " << Path << " to " << OutPath);
+
+    if (!passthroughFile(Path, OutPath))
+      return false;
+  }
+
+  return true;
+}
+
+bool runWorkerJob(const WorkerJob &Job, JobStats *Stats) {
+  std::unique_ptr<MemoryBuffer> Buf;
+  StringRef Data;
+  bool Member = !Job.Archive.empty();
+
+  if (!Member && classifyFile(Job.Path) == INPUT_NATIVE_OBJECT)
+    return passthroughFiles(Job.Path, Job.OutPaths);
+
+  if (Member) {
+    auto MemberBuf = MemoryBuffer::getFileSlice(Job.Path, Job.Size,
+                                                Job.Offset);
+
+    if (MemberBuf.getError()) {
+      errmsg(Job.Archive << "(" << Job.Name << "): cannot read member");
+      finishJobStats(Stats);
+      return false;
+    }
+
+    Buf = moveMemBuffer(MemberBuf.get());
+    Data = Buf->getBuffer();
+
+    if (Job.ObjectFDs.empty())
+      msg("codegen'ing " << Job.Archive << "(" << Job.Name << ") to "
+                         << Job.OutPaths[0]);
+    else
+      msg("codegen'ing " << Job.Archive << "(" << Job.Name << ")");
+  } else {
+    msg("codegen'ing " << Job.Path << " to " << Job.OutPaths[0]);
+  }
+
+  NativeCodeGenerator NCodeGen(Member ? Job.Name : Job.Path, Data);
+  NCodeGen.setOptions(Job.Opts);
+  NCodeGen.setOutputPath(Job.OutPaths[0]);
+  NCodeGen.setJobStats(Stats);
+
+  bool OK;
+
+  if (!Member) {
+    if (!(OK = NCodeGen.generateNativeCode()))
+      errmsg("cannot codegen " << Job.Path);
+  } else if ((OK = NCodeGen.generateNativeCodeMemory())) {
+    PhaseTimer Timer(Stats, PHASE_WRITE);
+    bool Variants = !getVariants().empty();
+    auto &FDs = Job.ObjectFDs;
+
+    for (size_t V = 0; V < Job.OutPaths.size() && OK; ++V) {
+      if (!FDs.empty())
+        OK = Variants ? NCodeGen.writeCodeToFD(FDs[V], V)
+                      : NCodeGen.writeCodeToFD(FDs[V]);
+      else
+        OK = Variants ? NCodeGen.writeCodeToFile(Job.OutPaths[V], V)
+                      : NCodeGen.writeCodeToFile(Job.OutPaths[V]);
     }
   }
 
+  finishJobStats(Stats);
   return OK;
 }
 
-} // end unnamed namespace
+const char *Overview = "bitcode to native object file converter\n";
 
-int main(int argc, char **argv) {
-  cl::ParseCommandLineOptions(argc, argv,
-                              "bitcode to native object file converter\n");
-  if (BitCodeFiles.empty()) {
+// Everything but parsing the options, collecting the inputs and
+// initializing the targets, which 'bc2obj -server' does only once.
+
+int convert(const std::vector<InputFile> &Inputs) {
+  if (Inputs.empty()) {
     errmsg("no bitcode files specified");
     return 1;
   }
 
-  for (auto &BCFile : BitCodeFiles) {
-    if (!BCFile.empty() && BCFile[0] == '-') {
-      errmsg("unknown option: " << BCFile);
-      return 1;
-    }
-  }
-
   if (sys::fs::create_directory(OutDir)) {
     errmsg("cannot create directory " << OutDir);
     return 1;
   }
 
-  InitializeAllTargets();
-  InitializeAllTargetMCs();
-  InitializeAllAsmPrinters();
-  InitializeAllAsmParsers();
+  if (!initObjectCache())
+    return 1;
+
+  initPassthrough();
 
   if (NumJobs <= 0)
     NumJobs = 1;
 
   ONUNIX(errmsg("using " << NumJobs << " job" << (NumJobs != 1 ? "s" : "")));
 
-  for (auto &BitCodeFile : BitCodeFiles) {
-    bool isFile;
+  if (!initJobs() || !initNUMA() || !initSplitCodeGen() || !initThinLTO() ||
+      !initLowMemory() || !initVariants() || !initProfile() ||
+      !initExports(Inputs) || !initWorkers(runWorkerJob))
+    return 1;
+
+  if (Engine != THREAD_ENGINE && !useExternalArchiver() &&
+      !initObjectTransport())
+    errmsg("no shared memory files, objects go through temporary files");
+
+  if (Incremental && ThinLTO) {
+    // Imports make the members depend on each other.
+    errmsg("'-incremental' has no effect with '-thin-lto'");
+    Incremental = false;
+  }
+
+  // Collect the jobs of all inputs and archive members up front, so that
+  // they can be scheduled as one queue.
+
+  std::deque<NativeArchive> Archives;
+  std::vector<Job> Jobs;
+  std::vector<ReportEntry> Entries;
+  std::set<std::string> OutDirs;
+  bool OK = true;
+
+  for (auto &Input : Inputs) {
+    const std::string &BitCodeFile = Input.Path;
+
+    // Inputs from directories are mirrored into subdirectories, and
+    // every -variant gets its own tree.
+    std::vector<std::string> OutPaths;
+
+    for (size_t V = 0; V < getVariants().size(); ++V)
+      OutPaths.push_back(getVariantPath(Input.OutPath, V));
+
+    if (OutPaths.empty())
+      OutPaths.push_back(Input.OutPath);
 
-    if (sys::fs::is_regular_file(BitCodeFile, isFile) || !isFile) {
-      errmsg(BitCodeFile << ": is not a file");
-      return 1;
+    for (auto &OutPath : OutPaths) {
+      StringRef Dir = sys::path::parent_path(OutPath);
+
+      if (!Dir.empty() && OutDirs.insert(Dir.str()).second &&
+          sys::fs::create_directories(Dir)) {
+        errmsg("cannot create directory " << Dir);
+        OK = false;
+        break;
+      }
     }
 
-    if (isArchive(BitCodeFile.c_str())) {
-      if (!createNativeArchive(BitCodeFile))
-        return 1;
+    if (!OK)
+      break;
+
+    InputKind Kind = classifyFile(BitCodeFile);
+
+    if (Kind == INPUT_ARCHIVE || Kind == INPUT_THIN_ARCHIVE) {
+      if (!(OK = addNativeArchive(Input, Archives, Jobs, Entries)))
+        break;
 
       continue;
     }
 
-    if (!waitForJob())
-      return 1;
+    uint64_t Size = 0;
+    sys::fs::file_size(BitCodeFile, Size);
 
-    if (!forkProcess(false)) {
-      bool OK;
-      bool isNativeObjectFile;
+    size_t Index = Entries.size();
+    Entries.push_back({BitCodeFile, Size, Kind == INPUT_NATIVE_OBJECT, false});
 
-      NativeCodeGenerator NCodeGen(BitCodeFile, OK, isNativeObjectFile);
+    Job NewJob;
 
-      if (OK) {
-        msg("codegen'ing " << BitCodeFile << " to "
-                           << NCodeGen.getOutputPath());
+    if (Entries[Index].Passthrough) {
+      // Cheap, and hardly any memory, after the bitcode jobs.
+      NewJob.Cost = 0;
+      NewJob.Index = Index;
+      NewJob.Run = [&Input, OutPaths] {
+        return passthroughFiles(Input.Path, OutPaths);
+      };
+
+      if (Engine == PREFORK_ENGINE) {
+        NewJob.Work.reset(new WorkerJob);
+        NewJob.Work->Path = BitCodeFile;
+        NewJob.Work->OutPaths = OutPaths;
+        NewJob.Work->Index = Index;
+      }
+
+      Jobs.push_back(std::move(NewJob));
+      continue;
+    }
+
+    NewJob.Cost = Size;
+    NewJob.Slots = getCodeGenSlots();
+    NewJob.Index = Index;
+    NewJob.Run = [&Input, Index] {
+      const std::string &BitCodeFile = Input.Path;
+      NativeCodeGenerator NCodeGen(BitCodeFile);
+      JobStats *Stats = getJobStats(Index);
+
+      NCodeGen.setOptions(Input.Opts);
+      NCodeGen.setOutputPath(Input.OutPath);
+
+      msg("codegen'ing " << BitCodeFile << " to "
+                         << NCodeGen.getOutputPath());
+
+      NCodeGen.setJobStats(Stats);
+      bool OK = NCodeGen.generateNativeCode();
+
+      if (!OK)
+        errmsg("cannot codegen " << BitCodeFile);
+
+      finishJobStats(Stats);
+      return OK;
+    };
+
+    if (Engine == PREFORK_ENGINE) {
+      NewJob.Work.reset(new WorkerJob);
+      NewJob.Work->Path = BitCodeFile;
+      NewJob.Work->OutPaths.push_back(Input.OutPath);
+      NewJob.Work->Opts = Input.Opts;
+      NewJob.Work->Index = Index;
+    }
+
+    Jobs.push_back(std::move(NewJob));
+  }
+
+  if (OK)
+    OK = initTimeReport(Entries.size());
+
+  // Largest first, so that the big modules don't end up as the tail.
+  std::stable_sort(Jobs.begin(), Jobs.end(), [](const Job &A, const Job &B) {
+    return A.Cost > B.Cost;
+  });
+
+  for (auto &Ar : Archives) {
+    if (OK && !Ar.PendingJobs)
+      OK = finishNativeArchive(Ar);
+  }
 
-        if (!NCodeGen.generateNativeCode()) {
-          errmsg("cannot codegen " << BitCodeFile);
-          return 1;
+  for (auto &Job : Jobs) {
+    if (!OK)
+      break;
+
+    std::vector<NativeArchive *> Ars = std::move(Job.Archives);
+    std::vector<NativeMember *> Objects = std::move(Job.Objects);
+    size_t Index = Job.Index;
+
+    for (auto *Object : Objects) {
+      if ((Object->ObjectFD = createObjectFD()) == -1) {
+        errmsg("cannot create a shared memory file");
+        OK = false;
+        break;
+      }
+
+      if (Job.Work)
+        Job.Work->ObjectFDs.push_back(Object->ObjectFD);
+    }
+
+    if (!OK)
+      break;
+
+    auto Done = [Ars, Objects, Index](bool JobOK) {
+      for (auto *Object : Objects) {
+        if (JobOK) {
+          auto &Code = Object->Code;
+
+          if ((Code.CodeBuf = readObjectFD(Object->ObjectFD))) {
+            Code.Code = Code.CodeBuf->getBufferStart();
+            Code.Length = Code.CodeBuf->getBufferSize();
+          } else {
+            errmsg(Object->Name << ": cannot map object");
+            JobOK = false;
+          }
+        } else {
+          close(Object->ObjectFD);
         }
+
+        Object->ObjectFD = -1;
+      }
+
+      bool OK = JobOK;
+      setJobStatus(Index, JobOK);
+
+      for (auto *Ar : Ars) {
+        if (!JobOK)
+          Ar->OK = false;
+
+        if (!--Ar->PendingJobs && !finishNativeArchive(*Ar))
+          OK = false;
       }
 
-      ONUNIX(NCodeGen.~NativeCodeGenerator());
-      childExit(!OK);
+      return OK;
+    };
+
+    if (Job.Work)
+      OK = runJob(*Job.Work, std::move(Done), Job.Cost, Job.Slots);
+    else
+      OK = runJob(std::move(Job.Run), std::move(Done), Job.Cost, Job.Slots);
+  }
+
+  if (!waitForJobs())
+    OK = false;
+
+  // Clean up after archives that didn't get that far.
+  for (auto &Ar : Archives) {
+    if (!Ar.Finished) {
+      Ar.OK = false;
+      finishNativeArchive(Ar);
+    }
+  }
+
+  finishJobs();
+  finishObjectCache();
+  printPassthroughStats();
+
+  if (!writeTimeReport(Entries))
+    OK = false;
+
+  return !OK;
+}
+
+// Every request of the server parses its options in a child of the
+// server, on top of what the server has parsed. LLVM keeps the number of
+// occurrences and the values of lists, so an option given to both would
+// be rejected, or accumulate. Hence the server only takes -server.
+
+bool isServerOnly(int argc, char **argv) {
+  for (int I = 1; I < argc; ++I) {
+    StringRef Arg = argv[I];
+
+    if (Arg.startswith("--"))
+      Arg = Arg.drop_front();
+
+    if (Arg == "-server") {
+      ++I; // the path
+      continue;
     }
 
-    ActiveJobs++;
+    if (!Arg.startswith("-server="))
+      return false;
+  }
+
+  return true;
+}
+
+} // end unnamed namespace
+
+int main(int argc, char **argv) {
+  auto StartTime = std::chrono::steady_clock::now();
+  cl::ParseCommandLineOptions(argc, argv, Overview);
+
+  if (!Server.empty() && (!BitCodeFiles.empty() || !InputLists.empty())) {
+    errmsg("'-server' doesn't take any input files");
+    return 1;
+  }
+
+  if (!Server.empty() && !isServerOnly(argc, argv)) {
+    errmsg("'-server' doesn't take any other options, pass them to "
+           "bc2obj-client");
+    return 1;
+  }
+
+  std::vector<InputFile> Inputs;
+
+  if (Server.empty() && !collectInputs(Inputs))
+    return 1;
+
+  // The server doesn't know the inputs of its requests yet.
+  size_t NumBackends = Server.empty() ? initTargets(Inputs) : initAllTargets();
+
+  double Startup = std::chrono::duration<double, std::milli>(
+                       std::chrono::steady_clock::now() - StartTime).count();
+
+  msg("startup: " << format("%.1f", Startup) << " ms, " << NumBackends
+                  << " of " << getNumBackends() << " backends initialized");
+
+  if (!Server.empty()) {
+    return runServer(Server, [](int argc, char **argv) {
+      cl::ParseCommandLineOptions(argc, argv, Overview);
+
+      std::vector<InputFile> Inputs;
+
+      if (!collectInputs(Inputs))
+        return 1;
+
+      return convert(Inputs);
+    });
   }
 
-  return !waitForJobs();
+  return convert(Inputs);
 }
@@ -0,0 +1,260 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// -numa: every job runs on the CPUs of one NUMA node, the least busy one
+// when it starts, and allocates from that node's memory. With -engine=
+// prefork the workers are spread over the nodes instead. The memory a
+// job allocates (its IR, the codegen buffers and the memfd it writes its
+// object to) is first touched on the node, so it stays there; the
+// preferred policy only makes sure an inherited policy (numactl
+// --interleave) doesn't move it elsewhere. Without libnuma, the topology
+// comes from sysfs.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+#include "bc2obj.h"
+
+#ifdef __linux__
+#include <dirent.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+#ifdef __linux__
+
+const int MPOL_PREFERRED_ = 1; // <linux/mempolicy.h>
+
+struct Node {
+  unsigned ID;
+  std::vector<unsigned> CPUs; // those we may run on
+  unsigned Jobs = 0;
+};
+
+std::vector<Node> Nodes;
+size_t MaxCPU; // + 1
+
+std::vector<unsigned> getAllowedCPUs() {
+  std::vector<unsigned> CPUs;
+
+  for (int NumCPUs = 1024; NumCPUs <= (1 << 20); NumCPUs *= 2) {
+    cpu_set_t *CS = CPU_ALLOC(NumCPUs);
+    size_t Size = CPU_ALLOC_SIZE(NumCPUs);
+
+    if (!CS)
+      break;
+
+    CPU_ZERO_S(Size, CS);
+
+    if (!sched_getaffinity(0, Size, CS)) {
+      for (int I = 0; I < NumCPUs; ++I)
+        if (CPU_ISSET_S(I, Size, CS))
+          CPUs.push_back(I);
+
+      CPU_FREE(CS);
+      break;
+    }
+
+    CPU_FREE(CS);
+  }
+
+  return CPUs;
+}
+
+// "0-3,8-11"
+bool parseCPUList(const char *List, std::vector<unsigned> &CPUs) {
+  while (*List && *List != '\n') {
+    char *End;
+    unsigned long First = strtoul(List, &End, 10), Last = First;
+
+    if (End == List)
+      return false;
+
+    if (*End == '-') {
+      List = End + 1;
+      Last = strtoul(List, &End, 10);
+
+      if (End == List || Last < First)
+        return false;
+    }
+
+    for (unsigned long CPU = First; CPU <= Last; ++CPU)
+      CPUs.push_back(CPU);
+
+    List = *End == ',' ? End + 1 : End;
+  }
+
+  return true;
+}
+
+bool readNodes(const std::vector<unsigned> &Allowed) {
+  DIR *Dir = opendir("/sys/devices/system/node");
+
+  if (!Dir)
+    return false;
+
+  while (dirent *Entry = readdir(Dir)) {
+    unsigned ID;
+    char Buf[4096];
+
+    if (sscanf(Entry->d_name, "node%u", &ID) != 1)
+      continue;
+
+    std::string Path = std::string("/sys/devices/system/node/") +
+                       Entry->d_name + "/cpulist";
+    FILE *F = fopen(Path.c_str(), "r");
+
+    if (!F)
+      continue;
+
+    std::vector<unsigned> CPUs;
+    bool OK = fgets(Buf, sizeof(Buf), F) && parseCPUList(Buf, CPUs);
+    fclose(F);
+
+    if (!OK)
+      continue;
+
+    Node N;
+    N.ID = ID;
+
+    for (unsigned CPU : CPUs)
+      if (std::binary_search(Allowed.begin(), Allowed.end(), CPU))
+        N.CPUs.push_back(CPU);
+
+    // Memory only nodes, or nodes outside of our cpuset.
+    if (!N.CPUs.empty())
+      Nodes.push_back(std::move(N));
+  }
+
+  closedir(Dir);
+
+  std::sort(Nodes.begin(), Nodes.end(),
+            [](const Node &A, const Node &B) { return A.ID < B.ID; });
+  return true;
+}
+
+#endif
+
+} // end unnamed namespace
+
+bool initNUMA() {
+  if (!NUMA)
+    return true;
+
+#ifdef __linux__
+  std::vector<unsigned> Allowed = getAllowedCPUs();
+
+  if (Allowed.empty() || !readNodes(Allowed)) {
+    errmsg("-numa: cannot read the NUMA topology");
+    return false;
+  }
+
+  MaxCPU = Allowed.back() + 1;
+
+  if (Nodes.size() < 2) {
+    errmsg("-numa: only one NUMA node, ignored");
+    Nodes.clear();
+    return true;
+  }
+
+  errmsg("placing jobs on " << Nodes.size() << " NUMA nodes");
+  return true;
+#else
+  errmsg("'-numa' is not supported on this platform");
+  return false;
+#endif
+}
+
+int acquireNode() {
+#ifdef __linux__
+  if (Nodes.empty())
+    return -1;
+
+  // Relative to its CPUs, a node with more CPUs takes more jobs.
+  size_t Best = 0;
+
+  for (size_t I = 1; I < Nodes.size(); ++I)
+    if (Nodes[I].Jobs * Nodes[Best].CPUs.size() <
+        Nodes[Best].Jobs * Nodes[I].CPUs.size())
+      Best = I;
+
+  Nodes[Best].Jobs++;
+  return Best;
+#else
+  return -1;
+#endif
+}
+
+void releaseNode(int Node) {
+#ifdef __linux__
+  if (Node >= 0 && Nodes[Node].Jobs > 0)
+    Nodes[Node].Jobs--;
+#else
+  (void)Node;
+#endif
+}
+
+int getWorkerNode(size_t Worker) {
+#ifdef __linux__
+  return Nodes.empty() ? -1 : static_cast<int>(Worker % Nodes.size());
+#else
+  (void)Worker;
+  return -1;
+#endif
+}
+
+void bindToNode(int Index) {
+#ifdef __linux__
+  if (Index < 0)
+    return;
+
+  const Node &N = Nodes[Index];
+  cpu_set_t *CS = CPU_ALLOC(MaxCPU);
+  size_t Size = CPU_ALLOC_SIZE(MaxCPU);
+
+  if (CS) {
+    CPU_ZERO_S(Size, CS);
+
+    for (unsigned CPU : N.CPUs)
+      CPU_SET_S(CPU, Size, CS);
+
+    // 0 is the calling thread, not the whole process.
+    if (sched_setaffinity(0, Size, CS))
+      errmsg("-numa: cannot bind to node " << N.ID);
+
+    CPU_FREE(CS);
+  }
+
+  const unsigned Bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> Mask(N.ID / Bits + 1);
+  Mask[N.ID / Bits] |= 1UL << (N.ID % Bits);
+
+  // Fails with ENOSYS without CONFIG_NUMA, first touch still applies.
+  syscall(SYS_set_mempolicy, MPOL_PREFERRED_, Mask.data(),
+          Mask.size() * Bits + 1);
+#else
+  (void)Index;
+#endif
+}
@@ -0,0 +1,169 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <fcntl.h>
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#endif
+
+#include "bc2obj.h"
+
+namespace {
+
+// Shared with forked jobs, they pass native objects through as well.
+struct PassthroughStats {
+  uint64_t Copied;    // through user space
+  uint64_t Offloaded; // by copy_file_range(), maybe reflinked
+  uint64_t Shared;    // hard links and reflinks
+};
+
+PassthroughStats *Stats;
+
+bool cloneFile(int FromFD, int ToFD) {
+#ifdef FICLONE
+  return ioctl(ToFD, FICLONE, FromFD) == 0;
+#else
+  return false;
+#endif
+}
+
+} // end unnamed namespace
+
+// Copies up to Length bytes at Offset of FromFD to the current position of
+// ToFD without going through user space. Returns the number of bytes the
+// kernel managed to copy, the caller is responsible for the rest.
+
+uint64_t copyFileRange(int FromFD, uint64_t Offset, int ToFD,
+                       uint64_t Length) {
+  uint64_t Done = 0;
+
+#if defined(__linux__) && defined(__NR_copy_file_range)
+  loff_t Off = Offset;
+
+  while (Done < Length) {
+    ssize_t Copied = syscall(__NR_copy_file_range, FromFD, &Off, ToFD,
+                             nullptr, Length - Done, 0);
+
+    if (Copied < 0 && errno == EINTR)
+      continue;
+
+    if (Copied <= 0)
+      break;
+
+    Done += Copied;
+  }
+
+  __sync_fetch_and_add(&Stats->Offloaded, Done);
+#endif
+
+  return Done;
+}
+
+void initPassthrough() {
+  if (!Stats)
+    Stats = static_cast<PassthroughStats *>(
+        allocSharedMemory(sizeof(PassthroughStats)));
+}
+
+bool passthroughFile(const std::string &From, const std::string &To) {
+#ifndef _WIN32
+  uint64_t Size;
+
+  if (sys::fs::file_size(From, Size)) {
+    errmsg(From << ": cannot stat file");
+    return false;
+  }
+
+  if (LinkNative) {
+    sys::fs::remove(To);
+
+    if (!link(From.c_str(), To.c_str())) {
+      __sync_fetch_and_add(&Stats->Shared, Size);
+      return true;
+    }
+  }
+
+  int FromFD;
+  int ToFD;
+
+  if (sys::fs::openFileForRead(From, FromFD)) {
+    errmsg(From << ": cannot open file");
+    return false;
+  }
+
+  if (sys::fs::openFileForWrite(To, ToFD, sys::fs::F_RW)) {
+    errmsg(To << ": cannot open file for writing");
+    close(FromFD);
+    return false;
+  }
+
+  bool OK = true;
+
+  if (cloneFile(FromFD, ToFD)) {
+    __sync_fetch_and_add(&Stats->Shared, Size);
+  } else {
+    uint64_t Done = copyFileRange(FromFD, 0, ToFD, Size);
+
+    // Start over with a plain copy below.
+    if (Done != Size) {
+      __sync_fetch_and_sub(&Stats->Offloaded, Done);
+      OK = false;
+    }
+  }
+
+  close(FromFD);
+  close(ToFD);
+
+  if (OK)
+    return true;
+#endif
+
+  if (sys::fs::copy_file(From, To)) {
+    errmsg("cannot copy " << From << " to " << To);
+    return false;
+  }
+
+  uint64_t CopiedSize;
+
+  if (!sys::fs::file_size(To, CopiedSize))
+    __sync_fetch_and_add(&Stats->Copied, CopiedSize);
+
+  return true;
+}
+
+void addCopiedBytes(uint64_t Length) {
+  __sync_fetch_and_add(&Stats->Copied, Length);
+}
+
+void printPassthroughStats() {
+  if (!Stats->Copied && !Stats->Offloaded && !Stats->Shared)
+    return;
+
+  // The file system may as well have shared the offloaded bytes.
+  errmsg("native objects: " << Stats->Copied << " bytes copied, "
+                            << Stats->Offloaded << " bytes offloaded "
+                            << "(copy_file_range), " << Stats->Shared
+                            << " bytes shared");
+}
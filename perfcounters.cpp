@@ -0,0 +1,194 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// -perf-counters: hardware counters around every phase of a job. The
+// counters are opened per thread, so they only count the job they are
+// read by, in a worker thread as well as in a forked child. Without
+// perf_event (not Linux, no PMU, perf_event_paranoid), only page faults
+// are available, from rusage.
+
+#include <cstring>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include "bc2obj.h"
+
+namespace {
+
+CounterSource Source = COUNTERS_NONE;
+
+#ifdef __linux__
+
+const struct {
+  uint32_t Type;
+  uint64_t Config;
+} Events[NUM_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}};
+
+class CounterGroup {
+public:
+  ~CounterGroup() { close(); }
+
+  bool read(uint64_t *Values);
+
+private:
+  bool open();
+  void close();
+
+  int FDs[NUM_COUNTERS];
+  pid_t Owner = 0; // counters opened before a fork count the parent
+  bool Open = false;
+  bool Failed = false;
+};
+
+thread_local CounterGroup Group;
+
+int openEvent(unsigned Counter, int GroupFD) {
+  struct perf_event_attr Attr;
+
+  memset(&Attr, 0, sizeof(Attr));
+  Attr.size = sizeof(Attr);
+  Attr.type = Events[Counter].Type;
+  Attr.config = Events[Counter].Config;
+  Attr.read_format = PERF_FORMAT_GROUP;
+  // User space only, that is allowed up to perf_event_paranoid=2.
+  Attr.exclude_kernel = 1;
+  Attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &Attr, 0, -1, GroupFD,
+                 PERF_FLAG_FD_CLOEXEC);
+}
+
+bool CounterGroup::open() {
+  if (Open && Owner == getpid())
+    return true;
+
+  close();
+
+  if (Failed)
+    return false;
+
+  for (unsigned Counter = 0; Counter < NUM_COUNTERS; ++Counter) {
+    FDs[Counter] = openEvent(Counter, Counter ? FDs[0] : -1);
+
+    if (FDs[Counter] < 0) {
+      while (Counter--)
+        ::close(FDs[Counter]);
+
+      Failed = true;
+      return false;
+    }
+  }
+
+  Owner = getpid();
+  Open = true;
+  return true;
+}
+
+void CounterGroup::close() {
+  if (!Open)
+    return;
+
+  for (int FD : FDs)
+    ::close(FD);
+
+  Open = false;
+}
+
+bool CounterGroup::read(uint64_t *Values) {
+  if (!open())
+    return false;
+
+  struct {
+    uint64_t NumCounters;
+    uint64_t Values[NUM_COUNTERS];
+  } Buf;
+
+  if (::read(FDs[0], &Buf, sizeof(Buf)) != sizeof(Buf))
+    return false;
+
+  memcpy(Values, Buf.Values, sizeof(Buf.Values));
+  return true;
+}
+
+#endif
+
+void readRUsage(uint64_t *Values) {
+#ifndef _WIN32
+  struct rusage Usage;
+
+#ifdef RUSAGE_THREAD
+  if (getrusage(RUSAGE_THREAD, &Usage))
+#else
+  if (getrusage(RUSAGE_SELF, &Usage))
+#endif
+    return;
+
+  Values[COUNTER_PAGE_FAULTS] = Usage.ru_minflt + Usage.ru_majflt;
+#else
+  (void)Values;
+#endif
+}
+
+} // end unnamed namespace
+
+const char *CounterNames[NUM_COUNTERS] = {"cycles", "instructions",
+                                          "cache_misses", "branch_misses",
+                                          "page_faults"};
+
+void initPerfCounters() {
+  uint64_t Values[NUM_COUNTERS];
+  (void)Values;
+
+  Source = COUNTERS_RUSAGE;
+
+#ifdef __linux__
+  if (Group.read(Values))
+    Source = COUNTERS_PERF_EVENT;
+#endif
+}
+
+CounterSource getCounterSource() { return Source; }
+
+void readPerfCounters(uint64_t *Values) {
+  memset(Values, 0, sizeof(uint64_t) * NUM_COUNTERS);
+
+#ifdef __linux__
+  if (Source == COUNTERS_PERF_EVENT && Group.read(Values))
+    return;
+#endif
+
+  if (Source != COUNTERS_NONE)
+    readRUsage(Values);
+}
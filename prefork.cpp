@@ -0,0 +1,457 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// -engine=prefork: NumJobs worker processes, forked once before any
+// input is mapped, so that they don't inherit the mappings of the
+// parent, and reused for many jobs. They keep what the targets
+// initialize lazily. A job goes to an idle worker over its socket pair:
+//
+//   uint32_t Length, then the fields of the WorkerJob, each terminated
+//   by '\0'
+//
+// along with the object FDs of the job (SCM_RIGHTS), and the worker
+// replies with a WorkerReply. A worker that dies takes
+// its job with it, it is replaced by a new one (forked from the parent
+// as it is by then).
+
+#include <cerrno>
+#include <cstring>
+
+#include "bc2obj.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#endif
+
+namespace {
+
+struct Worker {
+  pid_t Pid = -1;
+  int FD = -1;
+  bool Busy = false;
+  unsigned long ID;    // of the job
+  size_t Index;        // of the job, into the time report
+};
+
+struct WorkerReply {
+  int32_t OK;
+  JobStats Stats;
+};
+
+const size_t MaxObjectFDs = 250; // below SCM_MAX_FD
+
+std::vector<Worker> Workers;
+WorkerRun Run;
+
+void addField(std::string &Data, const std::string &Field) {
+  Data += Field;
+  Data += '\0';
+}
+
+void addField(std::string &Data, uint64_t Field) {
+  addField(Data, std::to_string(Field));
+}
+
+std::string encodeJob(const WorkerJob &Job) {
+  std::string Data;
+
+  addField(Data, Job.Path);
+  addField(Data, Job.Archive);
+  addField(Data, Job.Name);
+  addField(Data, Job.Offset);
+  addField(Data, Job.Size);
+  addField(Data, Job.Index);
+  addField(Data, Job.Slots);
+  addField(Data, Job.Opts.Target);
+  addField(Data, Job.Opts.CPU);
+  addField(Data, Job.Opts.Attrs);
+  addField(Data, Job.Opts.OptLevel);
+  addField(Data, Job.Opts.PIC);
+  addField(Data, Job.Opts.PIE);
+  addField(Data, Job.Opts.GenerateDebugSymbols);
+
+  for (auto &OutPath : Job.OutPaths)
+    addField(Data, OutPath);
+
+  return Data;
+}
+
+bool decodeJob(StringRef Data, WorkerJob &Job) {
+  SmallVector<StringRef, 16> Fields;
+  uint64_t Index, Slots, OptLevel, PIC, PIE, GenerateDebugSymbols;
+
+  if (Data.empty() || Data.back() != '\0')
+    return false;
+
+  Data.drop_back().split(Fields, StringRef("\0", 1), -1, true);
+
+  if (Fields.size() < 15)
+    return false;
+
+  Job.Path = Fields[0].str();
+  Job.Archive = Fields[1].str();
+  Job.Name = Fields[2].str();
+  Job.Opts.Target = Fields[7].str();
+  Job.Opts.CPU = Fields[8].str();
+  Job.Opts.Attrs = Fields[9].str();
+
+  if (Fields[3].getAsInteger(10, Job.Offset) ||
+      Fields[4].getAsInteger(10, Job.Size) ||
+      Fields[5].getAsInteger(10, Index) ||
+      Fields[6].getAsInteger(10, Slots) ||
+      Fields[10].getAsInteger(10, OptLevel) ||
+      Fields[11].getAsInteger(10, PIC) || Fields[12].getAsInteger(10, PIE) ||
+      Fields[13].getAsInteger(10, GenerateDebugSymbols))
+    return false;
+
+  Job.Index = Index;
+  Job.Slots = Slots;
+  Job.Opts.OptLevel = OptLevel;
+  Job.Opts.PIC = PIC;
+  Job.Opts.PIE = PIE;
+  Job.Opts.GenerateDebugSymbols = GenerateDebugSymbols;
+
+  for (size_t I = 14; I < Fields.size(); ++I)
+    Job.OutPaths.push_back(Fields[I].str());
+
+  return Job.ObjectFDs.empty() || Job.ObjectFDs.size() == Job.OutPaths.size();
+}
+
+#ifndef _WIN32
+
+// Writing to a worker that has died must fail with EPIPE instead of
+// killing the parent with SIGPIPE. Where MSG_NOSIGNAL is missing, the
+// socket has SO_NOSIGPIPE set instead (see spawnWorker()).
+#ifdef MSG_NOSIGNAL
+const int SendFlags = MSG_NOSIGNAL;
+#else
+const int SendFlags = 0;
+#endif
+
+bool sendAll(int FD, const char *Data, size_t Length) {
+  while (Length > 0) {
+    ssize_t Sent = send(FD, Data, Length, SendFlags);
+
+    if (Sent < 0 && errno == EINTR)
+      continue;
+
+    if (Sent <= 0)
+      return false;
+
+    Data += Sent;
+    Length -= Sent;
+  }
+
+  return true;
+}
+
+bool sendLength(int FD, uint32_t Length, const std::vector<int> &FDs) {
+  char Control[CMSG_SPACE(sizeof(int) * MaxObjectFDs)];
+  struct iovec IOV = {&Length, sizeof(Length)};
+  struct msghdr Msg;
+
+  memset(&Msg, 0, sizeof(Msg));
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+
+  if (!FDs.empty()) {
+    Msg.msg_control = Control;
+    Msg.msg_controllen = CMSG_SPACE(sizeof(int) * FDs.size());
+
+    struct cmsghdr *CMsg = CMSG_FIRSTHDR(&Msg);
+    CMsg->cmsg_level = SOL_SOCKET;
+    CMsg->cmsg_type = SCM_RIGHTS;
+    CMsg->cmsg_len = CMSG_LEN(sizeof(int) * FDs.size());
+    memcpy(CMSG_DATA(CMsg), FDs.data(), sizeof(int) * FDs.size());
+  }
+
+  ssize_t Sent;
+
+  do
+    Sent = sendmsg(FD, &Msg, SendFlags);
+  while (Sent < 0 && errno == EINTR);
+
+  return Sent == sizeof(Length);
+}
+
+bool receiveLength(int FD, uint32_t &Length, std::vector<int> &FDs) {
+  char Control[CMSG_SPACE(sizeof(int) * MaxObjectFDs)];
+  struct iovec IOV = {&Length, sizeof(Length)};
+  struct msghdr Msg;
+
+  memset(&Msg, 0, sizeof(Msg));
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control;
+  Msg.msg_controllen = sizeof(Control);
+
+  ssize_t Received;
+
+  do
+    Received = recvmsg(FD, &Msg, MSG_WAITALL);
+  while (Received < 0 && errno == EINTR);
+
+  if (Received != sizeof(Length))
+    return false;
+
+  for (struct cmsghdr *CMsg = CMSG_FIRSTHDR(&Msg); CMsg;
+       CMsg = CMSG_NXTHDR(&Msg, CMsg)) {
+    if (CMsg->cmsg_level != SOL_SOCKET || CMsg->cmsg_type != SCM_RIGHTS)
+      continue;
+
+    size_t Count = (CMsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const int *Data = reinterpret_cast<const int *>(CMSG_DATA(CMsg));
+    FDs.insert(FDs.end(), Data, Data + Count);
+  }
+
+  return true;
+}
+
+void workerLoop(int FD) {
+  // The time report of the parent isn't set up yet, the stats go back
+  // with every reply.
+  bool WantStats = !TimeReport.empty();
+
+  if (WantStats && PerfCounters)
+    initPerfCounters();
+
+  for (;;) {
+    uint32_t Length;
+    WorkerJob Job;
+
+    if (!receiveLength(FD, Length, Job.ObjectFDs))
+      break; // the parent is done
+
+    std::string Data(Length, '\0');
+    WorkerReply Reply;
+
+    memset(&Reply, 0, sizeof(Reply));
+
+    if (!readAll(FD, &Data[0], Data.size()) || !decodeJob(Data, Job)) {
+      errmsg("worker: invalid job");
+      break;
+    }
+
+    JobSlots = Job.Slots;
+    Reply.OK = Run(Job, WantStats ? &Reply.Stats : nullptr);
+
+    for (int ObjectFD : Job.ObjectFDs)
+      close(ObjectFD);
+
+    if (!writeAll(FD, &Reply, sizeof(Reply)))
+      break;
+  }
+
+  _exit(0);
+}
+
+bool spawnWorker(Worker &W) {
+  int FDs[2];
+
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, FDs)) {
+    errmsg("socketpair() failed");
+    return false;
+  }
+
+  outs().flush();
+  pid_t pid = forkProcess(false);
+
+  if (!pid) {
+    close(FDs[0]);
+    bindToNode(getWorkerNode(&W - &Workers[0]));
+
+    for (auto &Other : Workers)
+      if (Other.FD != -1)
+        close(Other.FD);
+
+    workerLoop(FDs[1]);
+  }
+
+  close(FDs[1]);
+
+#ifdef SO_NOSIGPIPE
+  int On = 1;
+  setsockopt(FDs[0], SOL_SOCKET, SO_NOSIGPIPE, &On, sizeof(On));
+#endif
+
+  W.Pid = pid;
+  W.FD = FDs[0];
+  W.Busy = false;
+  return true;
+}
+
+// Reaps a worker that has gone away, and forks its replacement.
+
+void replaceWorker(Worker &W) {
+  close(W.FD);
+  W.FD = -1;
+
+  waitForChild(W.Pid);
+  errmsg("worker " << W.Pid << " died, starting a new one");
+
+  if (!spawnWorker(W))
+    W.Pid = -1;
+}
+
+#endif
+
+} // end unnamed namespace
+
+bool initWorkers(const WorkerRun &JobRun) {
+  if (Engine != PREFORK_ENGINE)
+    return true;
+
+#ifndef _WIN32
+  if (ThinLTO) {
+    // The imports live in the parent.
+    errmsg("'-thin-lto' can't be used with '-engine=prefork'");
+    return false;
+  }
+
+  Run = JobRun;
+  Workers.resize(NumJobs);
+
+  for (auto &W : Workers)
+    if (!spawnWorker(W))
+      return false;
+
+  return true;
+#else
+  (void)JobRun;
+  errmsg("'-engine=prefork' is not supported on this platform");
+  return false;
+#endif
+}
+
+void finishWorkers() {
+#ifndef _WIN32
+  // EOF on their socket makes them exit.
+  for (auto &W : Workers)
+    if (W.FD != -1)
+      close(W.FD);
+
+  for (auto &W : Workers)
+    if (W.Pid > 0)
+      waitForChild(W.Pid);
+#endif
+
+  Workers.clear();
+}
+
+bool submitWorkerJob(const WorkerJob &Job, unsigned long ID) {
+#ifndef _WIN32
+  std::string Data = encodeJob(Job);
+  uint32_t Length = Data.size();
+
+  if (Job.ObjectFDs.size() > MaxObjectFDs) {
+    errmsg("too many objects for one job");
+    return false;
+  }
+
+  auto Send = [&](Worker &W) {
+    return sendLength(W.FD, Length, Job.ObjectFDs) &&
+           sendAll(W.FD, Data.data(), Data.size());
+  };
+
+  for (auto &W : Workers) {
+    if (W.Busy || W.FD == -1)
+      continue;
+
+    // A worker that died while idle is replaced, and the replacement
+    // takes the job. If that fails too, the next idle worker does.
+    if (!Send(W)) {
+      replaceWorker(W);
+
+      if (W.FD == -1 || !Send(W))
+        continue;
+    }
+
+    W.Busy = true;
+    W.ID = ID;
+    W.Index = Job.Index;
+    return true;
+  }
+#else
+  (void)Job;
+  (void)ID;
+#endif
+
+  errmsg("no idle worker");
+  return false;
+}
+
+bool waitForWorker(unsigned long &ID, bool &OK, bool Block) {
+#ifndef _WIN32
+  std::vector<struct pollfd> PFDs;
+  std::vector<Worker *> Busy;
+
+  for (auto &W : Workers) {
+    if (W.Busy) {
+      PFDs.push_back({W.FD, POLLIN, 0});
+      Busy.push_back(&W);
+    }
+  }
+
+  if (PFDs.empty())
+    return false;
+
+  int Ready;
+
+  do
+    Ready = poll(PFDs.data(), PFDs.size(), Block ? -1 : 0);
+  while (Ready < 0 && errno == EINTR);
+
+  if (Ready <= 0)
+    return false;
+
+  for (size_t I = 0; I < PFDs.size(); ++I) {
+    if (!PFDs[I].revents)
+      continue;
+
+    Worker &W = *Busy[I];
+    WorkerReply Reply;
+
+    ID = W.ID;
+    W.Busy = false;
+
+    if (!readAll(W.FD, &Reply, sizeof(Reply))) {
+      OK = false;
+      replaceWorker(W);
+      return true;
+    }
+
+    OK = Reply.OK;
+
+    if (JobStats *Stats = getJobStats(W.Index))
+      *Stats = Reply.Stats;
+
+    return true;
+  }
+#else
+  (void)ID;
+  (void)OK;
+  (void)Block;
+#endif
+
+  return false;
+}
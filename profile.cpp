@@ -0,0 +1,186 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// -profile=<file>: sample profiles (perf + create_llvm_prof, or
+// llvm-profdata merge -sample) are attached to every module before the
+// optimizer runs. The SampleProfileLoader pass turns them into branch
+// weights, which inlining and block placement then follow. The profile
+// is matched by function name and by source line, so the bitcode needs
+// line tables (-gline-tables-only).
+
+#include <cstring>
+
+#include "bc2obj.h"
+
+#if LLVM_VERSION_GE(3, 7)
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/Support/Format.h>
+#include <llvm/ProfileData/SampleProfReader.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Transforms/IPO.h>
+#include <llvm/Transforms/Scalar.h>
+#endif
+
+namespace {
+std::string ProfileKey;
+
+// Read once by initProfile(), to tell what each module matches.
+std::map<std::string, uint64_t> ProfileSamples; // per function
+uint64_t TotalSamples;
+
+#if LLVM_VERSION_GE(3, 7)
+bool isInstrProfile(StringRef Data) {
+  if (Data.size() < 8)
+    return false;
+
+  // Indexed profiles are always little endian, raw profiles are written
+  // in the byte order of the host that ran the instrumented binary
+  // (64 and 32 bit variants: 'r' and 'R').
+  static const char *const Magics[] = {
+      "\xfflprofi\x81",                   // indexed
+      "\xfflprofr\x81", "\x81rforpl\xff", // raw, 64 bit
+      "\xfflprofR\x81", "\x81Rforpl\xff", // raw, 32 bit
+  };
+
+  for (const char *Magic : Magics)
+    if (!memcmp(Data.data(), Magic, 8))
+      return true;
+
+  return false;
+}
+
+bool readProfile() {
+  LLVMContext Context;
+  auto Reader = SampleProfileReader::create(Profile, Context);
+
+  if (std::error_code EC = Reader.getError()) {
+    errmsg(Profile << ": " << EC.message());
+    return false;
+  }
+
+  if (std::error_code EC = Reader.get()->read()) {
+    errmsg(Profile << ": " << EC.message());
+    return false;
+  }
+
+  for (auto &Entry : Reader.get()->getProfiles()) {
+    uint64_t Samples = Entry.second.getTotalSamples();
+    ProfileSamples[Entry.getKey().str()] = Samples;
+    TotalSamples += Samples;
+  }
+
+  return true;
+}
+#endif
+} // end unnamed namespace
+
+bool initProfile() {
+  ProfileKey.clear();
+  ProfileSamples.clear();
+  TotalSamples = 0;
+
+  if (Profile.empty())
+    return true;
+
+#if LLVM_VERSION_GE(3, 7)
+  if (LowMemory) {
+    errmsg("'-profile' can't be combined with '-low-memory'");
+    return false;
+  }
+
+  auto Buf = MemoryBuffer::getFile(Profile.c_str(), -1, false);
+
+  if (Buf.getError()) {
+    errmsg(Profile << ": cannot open profile");
+    return false;
+  }
+
+  StringRef Data = Buf.get()->getBuffer();
+
+  // Instrumentation profiles map counters to the AST, only clang can
+  // apply them.
+  if (isInstrProfile(Data)) {
+    errmsg(Profile << ": instrumentation profiles have to be applied when "
+                      "the bitcode is generated (clang -fprofile-instr-use), "
+                      "'-profile' takes sample profiles");
+    return false;
+  }
+
+  // The objects depend on the contents of the profile.
+  MD5 Hash;
+  MD5::MD5Result Result;
+  SmallString<32> Key;
+
+  Hash.update(Data);
+  Hash.final(Result);
+  MD5::stringifyResult(Result, Key);
+  ProfileKey = Key.c_str();
+
+  return readProfile();
+#else
+  errmsg("'-profile' requires LLVM 3.7 or later");
+  return false;
+#endif
+}
+
+const std::string &getProfileKey() { return ProfileKey; }
+
+#if LLVM_VERSION_GE(3, 7)
+
+bool applyProfile(Module &M, const std::string &Path) {
+  // The loader doesn't tell what it has matched, count it here.
+  unsigned NumFunctions = 0, NumMatched = 0;
+  uint64_t Samples = 0;
+
+  for (auto &F : M) {
+    if (F.isDeclaration())
+      continue;
+
+    NumFunctions++;
+
+    auto I = ProfileSamples.find(F.getName().str());
+
+    if (I != ProfileSamples.end()) {
+      NumMatched++;
+      Samples += I->second;
+    }
+  }
+
+  if (NumMatched && !M.getNamedMetadata("llvm.dbg.cu"))
+    errmsg("warning: " << Path << ": no line tables, the profile can't be "
+                          "applied (use -gline-tables-only)");
+
+  // The pass takes a file name only and reads the profile itself, once
+  // per module.
+  legacy::PassManager PM;
+  PM.add(createSampleProfileLoaderPass(Profile));
+  PM.run(M);
+
+  msg(Path << ": profile matched " << NumMatched << " of " << NumFunctions
+           << " functions, "
+           << format("%.1f", TotalSamples ? 100.0 * Samples / TotalSamples : 0)
+           << "% of the samples");
+
+  return true;
+}
+
+#endif
@@ -0,0 +1,328 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <cstring>
+#include <set>
+#include <llvm/Support/TargetRegistry.h>
+
+#include "bc2obj.h"
+
+#ifndef _WIN32
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+namespace {
+
+// Targets used by the requests, reported by any process of the server
+// through shared memory. The server creates a target machine for each of
+// them, so that every later request is forked with the lazily
+// initialized parts of the target (MC layer, subtarget tables) in place.
+
+const unsigned MaxWarmTargets = 32;
+
+struct WarmTargetSlot {
+  volatile bool Ready;
+  char Key[252]; // "<triple>\0<cpu>\0<attrs>"
+};
+
+struct WarmTargetTable {
+  unsigned Count;
+  WarmTargetSlot Slots[MaxWarmTargets];
+};
+
+WarmTargetTable *WarmTargets;
+
+bool getWarmTargetKey(const std::string &Triple, const std::string &CPU,
+                      const std::string &Attrs, std::string &Key) {
+  Key = Triple;
+  Key += '\0';
+  Key += CPU;
+  Key += '\0';
+  Key += Attrs;
+  return Key.size() < sizeof(WarmTargetSlot::Key);
+}
+
+bool isWarmTarget(const std::string &Key) {
+  unsigned Count = std::min(WarmTargets->Count, MaxWarmTargets);
+
+  for (unsigned I = 0; I < Count; ++I) {
+    const WarmTargetSlot &Slot = WarmTargets->Slots[I];
+
+    if (Slot.Ready && !memcmp(Slot.Key, Key.data(), Key.size() + 1))
+      return true;
+  }
+
+  return false;
+}
+
+// Called by the server between requests.
+
+void warmUpTargets() {
+  static unsigned Seen;
+  static std::set<std::string> Keys;
+  static std::vector<std::unique_ptr<TargetMachine>> TMs;
+
+  for (; Seen < std::min(WarmTargets->Count, MaxWarmTargets); ++Seen) {
+    const WarmTargetSlot &Slot = WarmTargets->Slots[Seen];
+
+    if (!Slot.Ready)
+      break; // still being written, look again later
+
+    const char *Key = Slot.Key;
+    std::string Triple = Key;
+    std::string CPU = Key + Triple.size() + 1;
+    std::string Attrs = Key + Triple.size() + CPU.size() + 2;
+
+    if (!Keys.insert(Triple + '\0' + CPU + '\0' + Attrs).second)
+      continue;
+
+    std::string errMsg;
+    const llvm::Target *T = TargetRegistry::lookupTarget(Triple, errMsg);
+
+    if (!T)
+      continue;
+
+    msg("warming up " << Triple << (CPU.empty() ? "" : " (") << CPU
+                      << (CPU.empty() ? "" : ")"));
+
+    TMs.emplace_back(
+        T->createTargetMachine(Triple, CPU, Attrs, TargetOptions()));
+  }
+}
+
+#ifndef _WIN32
+
+volatile sig_atomic_t Quit;
+
+void quitHandler(int) { Quit = 1; }
+
+// Receives the header, stdout and stderr of the client, the working
+// directory and the arguments.
+
+bool readRequest(int Conn, int (&FDs)[2], std::string &Dir,
+                 std::vector<std::string> &Args) {
+  RequestHeader Header;
+  char Control[CMSG_SPACE(sizeof(FDs))];
+  struct iovec IOV = {&Header, sizeof(Header)};
+  struct msghdr Msg;
+
+  memset(&Msg, 0, sizeof(Msg));
+  Msg.msg_iov = &IOV;
+  Msg.msg_iovlen = 1;
+  Msg.msg_control = Control;
+  Msg.msg_controllen = sizeof(Control);
+
+  if (recvmsg(Conn, &Msg, MSG_WAITALL) != sizeof(Header))
+    return false;
+
+  struct cmsghdr *CMsg = CMSG_FIRSTHDR(&Msg);
+
+  if (!CMsg || CMsg->cmsg_level != SOL_SOCKET ||
+      CMsg->cmsg_type != SCM_RIGHTS ||
+      CMsg->cmsg_len != CMSG_LEN(sizeof(FDs)))
+    return false;
+
+  memcpy(FDs, CMSG_DATA(CMsg), sizeof(FDs));
+
+  if (Header.Magic != ServerMagic || Header.Length > MaxRequestLength)
+    return false;
+
+  std::string Data(Header.Length, '\0');
+
+  if (!readAll(Conn, &Data[0], Data.size()) || Data.empty() ||
+      Data.back() != '\0')
+    return false;
+
+  for (size_t Pos = 0; Pos < Data.size();) {
+    size_t End = Data.find('\0', Pos);
+    Args.push_back(Data.substr(Pos, End - Pos));
+    Pos = End + 1;
+  }
+
+  Dir = Args.front();
+  Args.erase(Args.begin());
+
+  return !Args.empty();
+}
+
+int handleRequest(int Conn,
+                  const std::function<int(int argc, char **argv)> &Run) {
+  int FDs[2];
+  std::string Dir;
+  std::vector<std::string> Args;
+
+  if (!readRequest(Conn, FDs, Dir, Args)) {
+    errmsg("invalid request");
+    return 1;
+  }
+
+  dup2(FDs[0], STDOUT_FILENO);
+  dup2(FDs[1], STDERR_FILENO);
+  close(FDs[0]);
+  close(FDs[1]);
+
+  int32_t Status = 1;
+
+  if (chdir(Dir.c_str())) {
+    errmsg(Dir << ": cannot change directory");
+  } else {
+    std::vector<char *> Argv;
+
+    for (auto &Arg : Args)
+      Argv.push_back(&Arg[0]);
+
+    Argv.push_back(nullptr);
+    Status = Run(Argv.size() - 1, Argv.data());
+  }
+
+  outs().flush();
+
+  if (write(Conn, &Status, sizeof(Status)) != sizeof(Status))
+    return 1;
+
+  return Status;
+}
+
+void reapRequests() {
+  while (waitpid(-1, nullptr, WNOHANG) > 0)
+    ;
+}
+
+#endif
+
+} // end unnamed namespace
+
+int runServer(const std::string &Path,
+              const std::function<int(int argc, char **argv)> &Run) {
+#ifndef _WIN32
+  struct sockaddr_un Addr;
+  struct stat Stat;
+
+  if (Path.size() >= sizeof(Addr.sun_path)) {
+    errmsg(Path << ": socket path too long");
+    return 1;
+  }
+
+  // Replace the socket of a server that is gone, but nothing else.
+  if (!lstat(Path.c_str(), &Stat)) {
+    if (!S_ISSOCK(Stat.st_mode)) {
+      errmsg(Path << ": exists and is not a socket");
+      return 1;
+    }
+
+    unlink(Path.c_str());
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sun_family = AF_UNIX;
+  strcpy(Addr.sun_path, Path.c_str());
+
+  if (fd == -1 || bind(fd, reinterpret_cast<sockaddr *>(&Addr),
+                       sizeof(Addr)) ||
+      listen(fd, 64)) {
+    errmsg(Path << ": cannot listen on socket");
+    if (fd != -1)
+      close(fd);
+    return 1;
+  }
+
+  WarmTargets =
+      static_cast<WarmTargetTable *>(allocSharedMemory(sizeof(WarmTargetTable)));
+
+  signal(SIGINT, quitHandler);
+  signal(SIGTERM, quitHandler);
+
+  errmsg("listening on " << Path);
+
+  struct pollfd PFD = {fd, POLLIN, 0};
+  int Status = 0;
+
+  while (!Quit) {
+    reapRequests();
+    warmUpTargets();
+
+    // Wake up now and then to reap requests and to warm up targets.
+    if (poll(&PFD, 1, 1000) <= 0)
+      continue;
+
+    int Conn = accept(fd, nullptr, nullptr);
+
+    if (Conn == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+
+      errmsg("accept() failed");
+      Status = 1;
+      break;
+    }
+
+    outs().flush();
+    pid_t pid = fork();
+
+    if (!pid) {
+      signal(SIGINT, SIG_DFL);
+      signal(SIGTERM, SIG_DFL);
+      close(fd);
+      _exit(handleRequest(Conn, Run));
+    }
+
+    if (pid < 0)
+      errmsg("fork() failed");
+
+    close(Conn);
+  }
+
+  close(fd);
+  unlink(Path.c_str());
+  return Status;
+#else
+  (void)Path;
+  (void)Run;
+  errmsg("'-server' is not supported on this platform");
+  return 1;
+#endif
+}
+
+void noteTarget(const std::string &Triple, const std::string &CPU,
+                const std::string &Attrs) {
+  std::string Key;
+
+  if (!WarmTargets || !getWarmTargetKey(Triple, CPU, Attrs, Key) ||
+      isWarmTarget(Key))
+    return;
+
+  unsigned Slot = __sync_fetch_and_add(&WarmTargets->Count, 1);
+
+  if (Slot >= MaxWarmTargets)
+    return;
+
+  memcpy(WarmTargets->Slots[Slot].Key, Key.data(), Key.size() + 1);
+  __sync_synchronize();
+  WarmTargets->Slots[Slot].Ready = true;
+}
@@ -0,0 +1,38 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// Protocol between bc2obj-client and 'bc2obj -server=<socket>'.
+//
+// The client sends a RequestHeader, along with its stdout and stderr
+// (SCM_RIGHTS), followed by Length bytes: the working directory and the
+// arguments, each terminated by '\0'. The server replies with the exit
+// status as int32_t once the request is done.
+
+#include <stdint.h>
+
+const uint32_t ServerMagic = 0x6263326f; // "bc2o"
+const uint32_t MaxRequestLength = 16 << 20;
+
+struct RequestHeader {
+  uint32_t Magic;
+  uint32_t Length;
+};
@@ -0,0 +1,478 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <algorithm>
+#include <set>
+
+#include "bc2obj.h"
+#include "threadpool.h"
+
+#if LLVM_VERSION_GE(3, 7)
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/Mangler.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#endif
+
+bool initSplitCodeGen() {
+  if (SplitCodeGen <= 1)
+    return true;
+
+#if LLVM_VERSION_GE(3, 7)
+  if (!llvm_is_multithreaded()) {
+    errmsg("'-split-codegen' requires a multithreaded LLVM build");
+    return false;
+  }
+
+  return true;
+#else
+  errmsg("'-split-codegen' requires LLVM 3.7 or later");
+  return false;
+#endif
+}
+
+unsigned getSplitSlots() {
+  if (SplitCodeGen <= 1 || NumJobs <= 1)
+    return 1;
+
+  return std::min<unsigned>(SplitCodeGen, NumJobs);
+}
+
+#if LLVM_VERSION_GE(3, 7)
+
+namespace {
+
+// Global values that have to be defined in the same partition.
+
+struct Group {
+  uint64_t Size = 0;
+  std::vector<GlobalValue *> Members;
+};
+
+uint64_t getFunctionSize(const Function &F) {
+  uint64_t Size = 0;
+  for (auto &BB : F)
+    Size += BB.size();
+  return Size;
+}
+
+bool isPartitioned(const GlobalValue &GV) {
+  // Module level metadata-like globals (llvm.used, llvm.global_ctors, ...)
+  // stay in the first partition only.
+  return !GV.isDeclaration() && !GV.hasAvailableExternallyLinkage() &&
+         !GV.hasAppendingLinkage() && !GV.getName().startswith("llvm.");
+}
+
+// Internal symbols may be referenced from any partition now. Make them
+// hidden globals, with a per-module suffix so that they can't clash with
+// the module's own symbols. Their symbol names go to Promoted, they are
+// made local again once the partitions have been linked.
+
+void externalizeLocals(Module &M, StringRef Suffix,
+                       std::vector<std::string> &Promoted) {
+  Mangler Mang;
+
+  auto Externalize = [&](GlobalValue &GV) {
+    if (!GV.hasLocalLinkage())
+      return;
+    GV.setName((GV.hasName() ? GV.getName() : "__bc2obj_anon") + Suffix);
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setVisibility(GlobalValue::HiddenVisibility);
+
+    SmallString<64> Name;
+    Mang.getNameWithPrefix(Name, &GV, false);
+    Promoted.push_back(Name.c_str());
+  };
+
+  for (auto &F : M)
+    Externalize(F);
+  for (auto &GV : M.globals())
+    Externalize(GV);
+  for (auto &GA : M.aliases())
+    Externalize(GA);
+}
+
+std::vector<Group> groupGlobals(Module &M) {
+  std::vector<Group> Groups;
+  std::map<const GlobalValue *, size_t> GroupOf;
+  std::map<const Comdat *, size_t> ComdatGroup;
+
+  auto Add = [&](GlobalObject &GO, uint64_t Size) {
+    size_t G;
+    const Comdat *C = GO.getComdat();
+
+    if (C && ComdatGroup.count(C)) {
+      G = ComdatGroup[C];
+    } else {
+      G = Groups.size();
+      Groups.emplace_back();
+      if (C)
+        ComdatGroup[C] = G;
+    }
+
+    Groups[G].Size += Size;
+    Groups[G].Members.push_back(&GO);
+    GroupOf[&GO] = G;
+  };
+
+  for (auto &F : M)
+    if (isPartitioned(F))
+      Add(F, getFunctionSize(F));
+
+  for (auto &GV : M.globals())
+    if (isPartitioned(GV))
+      Add(GV, 1);
+
+  // Aliases go along with what they point to.
+  for (auto &GA : M.aliases()) {
+    const GlobalObject *Base = GA.getBaseObject();
+    auto I = Base ? GroupOf.find(Base) : GroupOf.end();
+
+    if (I == GroupOf.end()) {
+      if (Groups.empty())
+        Groups.emplace_back();
+      Groups[0].Members.push_back(&GA);
+    } else {
+      Groups[I->second].Members.push_back(&GA);
+    }
+  }
+
+  return Groups;
+}
+
+// Largest group first into the currently smallest partition.
+
+std::vector<std::vector<GlobalValue *>> partition(std::vector<Group> Groups,
+                                                  unsigned NumParts) {
+  std::stable_sort(Groups.begin(), Groups.end(),
+                   [](const Group &A, const Group &B) {
+                     return A.Size > B.Size;
+                   });
+
+  NumParts = std::max(1u, std::min<unsigned>(NumParts, Groups.size()));
+
+  std::vector<std::vector<GlobalValue *>> Parts(NumParts);
+  std::vector<uint64_t> PartSize(NumParts);
+
+  for (auto &G : Groups) {
+    size_t Smallest =
+        std::min_element(PartSize.begin(), PartSize.end()) - PartSize.begin();
+    PartSize[Smallest] += G.Size + 1;
+    Parts[Smallest].insert(Parts[Smallest].end(), G.Members.begin(),
+                           G.Members.end());
+  }
+
+  return Parts;
+}
+
+// Turns everything in the clone that is defined by another partition into
+// a declaration.
+
+void stripForeignDefinitions(Module &M, bool First,
+                             const std::set<std::string> &Own) {
+  auto isForeign = [&](const GlobalValue &GV) {
+    return isPartitioned(GV) && !Own.count(GV.getName().str());
+  };
+
+  for (auto I = M.alias_begin(); I != M.alias_end();) {
+    GlobalAlias &GA = *I++;
+
+    if (!isForeign(GA))
+      continue;
+
+    Type *Ty = GA.getType()->getElementType();
+    GlobalValue *Decl;
+
+    if (auto *FTy = dyn_cast<FunctionType>(Ty))
+      Decl = Function::Create(FTy, GlobalValue::ExternalLinkage, "", &M);
+    else
+      Decl = new GlobalVariable(M, Ty, false, GlobalValue::ExternalLinkage,
+                                nullptr, "", nullptr,
+                                GlobalValue::NotThreadLocal,
+                                GA.getType()->getAddressSpace());
+
+    Decl->takeName(&GA);
+    Decl->setVisibility(GA.getVisibility());
+    GA.replaceAllUsesWith(Decl);
+    GA.eraseFromParent();
+  }
+
+  for (auto &F : M) {
+    if (isForeign(F)) {
+      F.deleteBody();
+      F.setComdat(nullptr);
+    }
+  }
+
+  for (auto I = M.global_begin(); I != M.global_end();) {
+    GlobalVariable &GV = *I++;
+
+    if (!First && !GV.isDeclaration() &&
+        (GV.hasAppendingLinkage() || GV.getName().startswith("llvm."))) {
+      GV.eraseFromParent();
+      continue;
+    }
+
+    if (isForeign(GV)) {
+      GV.setInitializer(nullptr);
+      GV.setLinkage(GlobalValue::ExternalLinkage);
+      GV.setComdat(nullptr);
+    }
+  }
+}
+
+bool splitModule(Module &M, unsigned NumParts, StringRef Suffix,
+                 std::vector<std::string> &Parts,
+                 std::vector<std::string> &Promoted) {
+  externalizeLocals(M, Suffix, Promoted);
+
+  auto Partitions = partition(groupGlobals(M), NumParts);
+
+  for (size_t I = 0; I < Partitions.size(); ++I) {
+    std::set<std::string> Own;
+
+    for (auto *GV : Partitions[I])
+      Own.insert(GV->getName().str());
+
+    std::unique_ptr<Module> Part(CloneModule(&M));
+    stripForeignDefinitions(*Part, I == 0, Own);
+
+    Parts.emplace_back();
+    raw_string_ostream OS(Parts.back());
+    WriteBitcodeToFile(Part.get(), OS);
+    OS.flush();
+  }
+
+  return !Parts.empty();
+}
+
+std::string findTool(const std::string &TripleStr, const char *Name) {
+  std::string Program = sys::FindProgramByName(TripleStr + "-" + Name);
+
+  if (Program.empty())
+    Program = sys::FindProgramByName(Name);
+
+  return Program;
+}
+
+std::string findLinker(const std::string &TripleStr) {
+  if (!LD.empty())
+    return sys::FindProgramByName(LD);
+
+  return findTool(TripleStr, "ld");
+}
+
+// Merges the partition objects into one relocatable object.
+
+bool linkRelocatable(const std::string &TripleStr,
+                     std::vector<SmallString<128>> &Objects,
+                     const std::string &Output, std::string &errMsg) {
+  std::string Program = findLinker(TripleStr);
+
+  if (Program.empty()) {
+    errMsg = "unable to find a linker for '-split-codegen' (use -ld=<val>)";
+    return false;
+  }
+
+  std::vector<const char *> Args;
+
+  Args.push_back(Program.c_str());
+  Args.push_back("-r");
+  Args.push_back("-o");
+  Args.push_back(Output.c_str());
+
+  for (auto &Object : Objects)
+    Args.push_back(Object.c_str());
+
+  Args.push_back(nullptr);
+
+  bool ExecutionFailed = false;
+
+  return sys::ExecuteAndWait(Program.c_str(), Args.data(), nullptr, nullptr, 0,
+                             0, &errMsg, &ExecutionFailed) == 0 &&
+         !ExecutionFailed;
+}
+
+// Turns the symbols that externalizeLocals() has promoted back into
+// local ones, so that the object looks as if it hadn't been split.
+
+bool localizeSymbols(const std::string &TripleStr, const std::string &Object,
+                     const std::vector<std::string> &Symbols,
+                     std::string &errMsg) {
+  if (Symbols.empty())
+    return true;
+
+  std::string Program = findTool(TripleStr, "objcopy");
+
+  if (Program.empty()) {
+    errMsg = "unable to find objcopy for '-split-codegen'";
+    return false;
+  }
+
+  SmallString<128> ListPath;
+  int FD;
+
+  if (sys::fs::createTemporaryFile("bc2obj", "syms", FD, ListPath)) {
+    errMsg = "cannot create temporary file";
+    return false;
+  }
+
+  FileRemover ListRemover(ListPath);
+
+  {
+    raw_fd_ostream OS(FD, true);
+
+    for (auto &Symbol : Symbols)
+      OS << Symbol << '\n';
+  }
+
+  std::string ListArg = "--localize-symbols=" + ListPath.str().str();
+  std::vector<const char *> Args;
+
+  Args.push_back(Program.c_str());
+  Args.push_back(ListArg.c_str());
+  Args.push_back(Object.c_str());
+  Args.push_back(nullptr);
+
+  bool ExecutionFailed = false;
+
+  return sys::ExecuteAndWait(Program.c_str(), Args.data(), nullptr, nullptr, 0,
+                             0, &errMsg, &ExecutionFailed) == 0 &&
+         !ExecutionFailed;
+}
+
+} // end unnamed namespace
+
+bool splitCodeGen(LTOCodeGenerator &CodeGen, const std::string &Path,
+                  const std::string &TripleStr, const CodeGenOptions &Opts,
+                  std::unique_ptr<MemoryBuffer> &Out, std::string &errMsg) {
+  // The optimized module is only reachable through writeMergedModules().
+  SmallString<128> MergedPath;
+
+  if (sys::fs::createTemporaryFile("bc2obj", "bc", MergedPath)) {
+    errMsg = "cannot create temporary file";
+    return false;
+  }
+
+  FileRemover MergedRemover(MergedPath);
+
+  if (!CodeGen.writeMergedModules(MergedPath.c_str(), errMsg))
+    return false;
+
+  std::vector<std::string> Parts;
+  std::vector<std::string> Promoted;
+
+  {
+    auto Buf = MemoryBuffer::getFile(MergedPath);
+
+    if (std::error_code EC = Buf.getError()) {
+      errMsg = EC.message();
+      return false;
+    }
+
+    LLVMContext Context;
+    auto M = parseBitcodeFile(Buf.get()->getMemBufferRef(), Context);
+
+    if (std::error_code EC = M.getError()) {
+      errMsg = EC.message();
+      return false;
+    }
+
+    MD5 Hash;
+    MD5::MD5Result Result;
+    SmallString<32> Suffix(".bc2obj.");
+
+    Hash.update(Buf.get()->getBuffer());
+    Hash.final(Result);
+    MD5::stringifyResult(Result, Suffix);
+
+    if (!splitModule(*M.get(), SplitCodeGen, Suffix, Parts, Promoted)) {
+      errMsg = "cannot split module";
+      return false;
+    }
+  }
+
+  std::vector<SmallString<128>> Objects(Parts.size());
+  std::vector<std::unique_ptr<FileRemover>> Removers;
+
+  for (auto &Object : Objects) {
+    if (sys::fs::createTemporaryFile("bc2obj", "o", Object)) {
+      errMsg = "cannot create temporary file";
+      return false;
+    }
+    Removers.emplace_back(new FileRemover(Object));
+  }
+
+  // Each partition gets its own code generator and context. The job has
+  // been admitted for JobSlots threads.
+  ThreadPool Pool(std::min<size_t>(Parts.size(), JobSlots));
+
+  for (size_t I = 0; I < Parts.size(); ++I) {
+    Pool.async([&, I] {
+      NativeCodeGenerator NCodeGen(Path, Parts[I]);
+      NCodeGen.setPartition();
+      NCodeGen.setOptions(Opts);
+
+      return NCodeGen.generateNativeCodeMemory() &&
+             NCodeGen.writeCodeToFile(Objects[I].c_str());
+    }, I);
+  }
+
+  bool OK = true;
+
+  for (size_t I = 0; I < Parts.size(); ++I) {
+    unsigned long ID;
+    OK &= Pool.wait(ID);
+  }
+
+  if (!OK) {
+    errMsg = "code generation of a partition failed";
+    return false;
+  }
+
+  SmallString<128> Output;
+
+  if (sys::fs::createTemporaryFile("bc2obj", "o", Output)) {
+    errMsg = "cannot create temporary file";
+    return false;
+  }
+
+  FileRemover OutputRemover(Output);
+
+  if (!linkRelocatable(TripleStr, Objects, Output.c_str(), errMsg) ||
+      !localizeSymbols(TripleStr, Output.c_str(), Promoted, errMsg))
+    return false;
+
+  auto Buf = MemoryBuffer::getFile(Output);
+
+  if (std::error_code EC = Buf.getError()) {
+    errMsg = EC.message();
+    return false;
+  }
+
+  Out = moveMemBuffer(Buf.get());
+  return true;
+}
+
+#endif
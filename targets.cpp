@@ -0,0 +1,246 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// Initializing all backends of a full LLVM build costs more than many
+// small inputs take to convert. Only the backends of the triples found in
+// the inputs are initialized. 'make TARGETS=...' restricts the .def files
+// below (and the LLVM libraries bc2obj links) to a chosen set.
+
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/Support/TargetRegistry.h>
+
+#include "bc2obj.h"
+
+#if LLVM_VERSION_GE(3, 7)
+#include <llvm/Object/IRObjectFile.h>
+#endif
+
+namespace {
+
+struct Backend {
+  const char *Name;
+  void (*InitTargetInfo)();
+  void (*InitTarget)();
+  void (*InitTargetMC)();
+};
+
+#define LLVM_TARGET(TargetName)                                                \
+  {#TargetName, LLVMInitialize##TargetName##TargetInfo,                       \
+   LLVMInitialize##TargetName##Target, LLVMInitialize##TargetName##TargetMC},
+
+const Backend Backends[] = {
+#include "llvm/Config/Targets.def"
+};
+
+const size_t NumBackends = sizeof(Backends) / sizeof(Backends[0]);
+const size_t MaxPeekedInputs = 1000;
+
+void initAsmPrinter(StringRef Name) {
+#define LLVM_ASM_PRINTER(TargetName)                                           \
+  if (Name == #TargetName)                                                     \
+    LLVMInitialize##TargetName##AsmPrinter();
+#include "llvm/Config/AsmPrinters.def"
+}
+
+void initAsmParser(StringRef Name) {
+#define LLVM_ASM_PARSER(TargetName)                                            \
+  if (Name == #TargetName)                                                     \
+    LLVMInitialize##TargetName##AsmParser();
+#include "llvm/Config/AsmParsers.def"
+}
+
+TargetRegistry::iterator firstTarget() {
+#if LLVM_VERSION_GE(3, 6)
+  return TargetRegistry::targets().begin();
+#else
+  return TargetRegistry::begin();
+#endif
+}
+
+size_t countTargets() {
+  return std::distance(firstTarget(), TargetRegistry::iterator());
+}
+
+// A backend may register several targets (i.e. x86 and x86-64). Target
+// infos are cheap, so all of them are registered one by one to learn
+// which backend a target belongs to. New targets are put in front.
+
+std::map<const llvm::Target *, const Backend *> TargetBackends;
+
+void initTargetInfos() {
+  for (const Backend &B : Backends) {
+    size_t NumTargets = countTargets();
+    B.InitTargetInfo();
+
+    auto T = firstTarget();
+
+    for (size_t N = countTargets() - NumTargets; N > 0; --N, ++T)
+      TargetBackends[&*T] = &B;
+  }
+}
+
+void initBackend(const Backend &B) {
+  B.InitTarget();
+  B.InitTargetMC();
+  initAsmPrinter(B.Name);
+  initAsmParser(B.Name);
+}
+
+// Returns false if the triple can't be read.
+
+bool peekTargetTriple(StringRef Data, const std::string &Name,
+                      LLVMContext &Context, std::set<std::string> &Triples) {
+  std::string Triple;
+
+  switch (classifyInput(Data)) {
+  case INPUT_NATIVE_OBJECT:
+    return true;
+  case INPUT_BITCODE:
+    break;
+  case INPUT_EMBEDDED_BITCODE: {
+#if LLVM_VERSION_GE(3, 7)
+    auto BCData =
+        object::IRObjectFile::findBitcodeInMemBuffer(MemoryBufferRef(Data, Name));
+
+    if (BCData.getError())
+      return false;
+
+    Data = BCData->getBuffer();
+    break;
+#else
+    return false;
+#endif
+  }
+  default:
+    return false;
+  }
+
+#if LLVM_VERSION_GE(3, 7)
+  // Errors are reported by the conversion, don't let LLVM exit here.
+  Triple = getBitcodeTargetTriple(MemoryBufferRef(Data, Name), Context,
+                                  [](const DiagnosticInfo &) {});
+#elif LLVM_VERSION_GE(3, 6)
+  Triple = getBitcodeTargetTriple(MemoryBufferRef(Data, Name), Context);
+#else
+  std::unique_ptr<MemoryBuffer> Buf(MemoryBuffer::getMemBuffer(Data, Name, false));
+  Triple = getBitcodeTargetTriple(Buf.get(), Context);
+#endif
+
+  if (Triple.empty())
+    return false;
+
+  Triples.insert(Triple);
+  return true;
+}
+
+bool peekTargetTriples(const std::string &File, LLVMContext &Context,
+                       std::set<std::string> &Triples) {
+  InputKind Kind = classifyFile(File);
+
+  if (Kind == INPUT_ARCHIVE || Kind == INPUT_THIN_ARCHIVE) {
+    bool OK;
+    BitCodeArchive BCAr(File, OK);
+
+    if (!OK)
+      return false;
+
+    for (auto &Member : BCAr.getMembers()) {
+      if (!peekTargetTriple(Member.Data, Member.Name, Context, Triples))
+        return false;
+    }
+
+    return true;
+  }
+
+  if (Kind == INPUT_NATIVE_OBJECT)
+    return true;
+
+  auto Buf = MemoryBuffer::getFile(File.c_str(), -1, false);
+
+  if (Buf.getError())
+    return false;
+
+  return peekTargetTriple(Buf.get()->getBuffer(), File, Context, Triples);
+}
+
+} // end unnamed namespace
+
+size_t getNumBackends() { return NumBackends; }
+
+size_t initAllTargets() {
+  InitializeAllTargetInfos();
+
+  for (const Backend &B : Backends)
+    initBackend(B);
+
+  return NumBackends;
+}
+
+size_t initTargets(const std::vector<InputFile> &Inputs) {
+  std::set<std::string> Triples;
+  LLVMContext Context;
+
+  // Peeking into a whole tree of inputs takes longer than initializing
+  // all backends.
+  if (Inputs.size() > MaxPeekedInputs)
+    return initAllTargets();
+
+  for (auto &Input : Inputs) {
+    // Anything unexpected is left to the error handling of the
+    // conversion, with all backends in place.
+    if (!peekTargetTriples(Input.Path, Context, Triples))
+      return initAllTargets();
+
+    if (!Input.Opts.Target.empty())
+      Triples.insert(Input.Opts.Target);
+  }
+
+  // initVariants() runs later, the triple is the second field of
+  // <name>:<triple>:<cpu>:<attrs>.
+  for (auto &Spec : VariantSpecs) {
+    SmallVector<StringRef, 4> Fields;
+    StringRef(Spec).split(Fields, ":", -1, true);
+
+    if (Fields.size() > 1 && !Fields[1].empty())
+      Triples.insert(Fields[1].str());
+  }
+
+  initTargetInfos();
+
+  std::set<const Backend *> Needed;
+
+  for (auto &Triple : Triples) {
+    std::string errMsg;
+    auto I = TargetBackends.find(TargetRegistry::lookupTarget(Triple, errMsg));
+
+    if (I == TargetBackends.end())
+      return initAllTargets();
+
+    Needed.insert(I->second);
+  }
+
+  for (const Backend *B : Needed)
+    initBackend(*B);
+
+  return Needed.size();
+}
@@ -0,0 +1,278 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// Summary based cross-module importing between the members of one
+// bitcode archive.
+//
+// Parsing every member once gives a small index of all externally
+// visible function definitions and whether they can be copied into
+// another module.  Each member job then pulls the small functions it
+// calls from its sibling members in as available_externally definitions
+// before it is optimized, so that they can be inlined.  The copies are
+// dropped again after optimization, every symbol stays defined exactly
+// where it was before.
+
+#include <set>
+
+#include "bc2obj.h"
+
+#if LLVM_VERSION_GE(3, 7)
+#include <llvm/ADT/SmallPtrSet.h>
+#include <llvm/Bitcode/ReaderWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Linker/Linker.h>
+#endif
+
+bool initThinLTO() {
+  if (!ThinLTO)
+    return true;
+
+#if LLVM_VERSION_GE(3, 7)
+  return true;
+#else
+  errmsg("'-thin-lto' requires LLVM 3.7 or later");
+  return false;
+#endif
+}
+
+#if LLVM_VERSION_GE(3, 7)
+
+namespace {
+
+unsigned getFunctionSize(const Function &F) {
+  unsigned Size = 0;
+  for (auto &BB : F)
+    Size += BB.size();
+  return Size;
+}
+
+// A function can be copied into another module as long as it doesn't
+// refer to anything that is private to its own module.
+
+bool isImportable(const Function &F) {
+  if (F.hasFnAttribute(Attribute::NoInline) ||
+      F.hasFnAttribute(Attribute::Naked))
+    return false;
+
+  if (!F.hasExternalLinkage() && !F.hasLinkOnceODRLinkage() &&
+      !F.hasWeakODRLinkage())
+    return false;
+
+  if (getFunctionSize(F) > ImportLimit)
+    return false;
+
+  SmallPtrSet<const Value *, 32> Visited;
+  std::vector<const Value *> Worklist;
+
+  for (auto &BB : F)
+    for (auto &I : BB)
+      for (auto &Op : I.operands())
+        Worklist.push_back(Op);
+
+  while (!Worklist.empty()) {
+    const Value *V = Worklist.back();
+    Worklist.pop_back();
+
+    if (!isa<Constant>(V) || !Visited.insert(V).second)
+      continue;
+
+    if (isa<BlockAddress>(V) || isa<GlobalAlias>(V))
+      return false;
+
+    if (auto *GV = dyn_cast<GlobalValue>(V)) {
+      if (GV->hasLocalLinkage())
+        return false;
+      continue;
+    }
+
+    for (auto &Op : cast<Constant>(V)->operands())
+      Worklist.push_back(Op);
+  }
+
+  return true;
+}
+
+// Reduces a (lazily loaded) sibling module to the functions that are
+// imported from it, everything else becomes a declaration or goes away.
+
+bool stripToImports(Module &M, const std::set<std::string> &Imports) {
+  std::vector<GlobalValue *> Locals;
+
+  for (auto I = M.global_begin(); I != M.global_end();) {
+    GlobalVariable &GV = *I++;
+    if (GV.hasAppendingLinkage() || GV.getName().startswith("llvm."))
+      GV.eraseFromParent();
+  }
+
+  for (auto &F : M) {
+    if (!Imports.count(F.getName().str()))
+      continue;
+
+    if (F.materialize())
+      return false;
+
+    F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    F.setComdat(nullptr);
+  }
+
+  for (auto &F : M) {
+    if (F.isDeclaration() || Imports.count(F.getName().str()))
+      continue;
+
+    if (F.hasLocalLinkage())
+      Locals.push_back(&F);
+
+    F.deleteBody();
+    F.setComdat(nullptr);
+  }
+
+  for (auto &GV : M.globals()) {
+    if (GV.isDeclaration())
+      continue;
+
+    if (GV.hasLocalLinkage())
+      Locals.push_back(&GV);
+
+    GV.setInitializer(nullptr);
+    GV.setLinkage(GlobalValue::ExternalLinkage);
+    GV.setComdat(nullptr);
+  }
+
+  // Imported functions never refer to aliases.
+  for (auto I = M.alias_begin(); I != M.alias_end();) {
+    GlobalAlias &GA = *I++;
+    GA.replaceAllUsesWith(UndefValue::get(GA.getType()));
+    GA.eraseFromParent();
+  }
+
+  for (auto *GV : Locals)
+    if (GV->use_empty())
+      GV->eraseFromParent();
+
+  return true;
+}
+
+} // end unnamed namespace
+
+size_t ThinLTOIndex::addSummary(const std::string &Name, StringRef Data,
+                                bool &OK) {
+  LLVMContext Context;
+  auto M = parseBitcodeFile(MemoryBufferRef(Data, Name), Context);
+
+  if (std::error_code EC = M.getError()) {
+    errmsg(Name << ": " << EC.message());
+    OK = false;
+    return 0;
+  }
+
+  size_t Index = Modules.size();
+  Modules.push_back({Name, Data, M.get()->getTargetTriple()});
+
+  for (auto &F : *M.get()) {
+    if (F.isDeclaration() || F.hasLocalLinkage() ||
+        F.hasAvailableExternallyLinkage())
+      continue;
+
+    // The first definition of a linkonce function wins.
+    Functions.insert(std::make_pair(F.getName().str(),
+                                    FunctionInfo{Index, isImportable(F)}));
+  }
+
+  OK = true;
+  return Index;
+}
+
+bool ThinLTOIndex::importFunctions(size_t Index,
+                                   std::string &Bitcode) const {
+  const ModuleInfo &Info = Modules[Index];
+  LLVMContext Context;
+
+  auto Dest = parseBitcodeFile(MemoryBufferRef(Info.Data, Info.Name), Context);
+
+  if (std::error_code EC = Dest.getError()) {
+    errmsg(Info.Name << ": " << EC.message());
+    return false;
+  }
+
+  // Which functions to import from which sibling.
+  std::map<size_t, std::set<std::string>> Imports;
+
+  for (auto &F : *Dest.get()) {
+    if (!F.isDeclaration() || F.isIntrinsic() || F.use_empty())
+      continue;
+
+    auto I = Functions.find(F.getName().str());
+
+    if (I == Functions.end() || !I->second.Importable ||
+        I->second.Module == Index ||
+        Modules[I->second.Module].Triple != Info.Triple)
+      continue;
+
+    Imports[I->second.Module].insert(I->first);
+  }
+
+  if (Imports.empty())
+    return true;
+
+  Linker L(Dest.get().get());
+
+  for (auto &Import : Imports) {
+    const ModuleInfo &Src = Modules[Import.first];
+    auto Buf = MemoryBuffer::getMemBuffer(Src.Data, Src.Name, false);
+    auto M = getLazyBitcodeModule(std::move(Buf), Context);
+
+    if (std::error_code EC = M.getError()) {
+      errmsg(Src.Name << ": " << EC.message());
+      return false;
+    }
+
+    if (!stripToImports(*M.get(), Import.second) ||
+        L.linkInModule(M.get().get())) {
+      errmsg(Info.Name << ": cannot import functions from " << Src.Name);
+      return false;
+    }
+  }
+
+  raw_string_ostream OS(Bitcode);
+  WriteBitcodeToFile(Dest.get().get(), OS);
+  OS.flush();
+
+  return true;
+}
+
+#else
+
+// initThinLTO() rejects -thin-lto, these are never reached.
+
+size_t ThinLTOIndex::addSummary(const std::string &, StringRef, bool &OK) {
+  errmsg("'-thin-lto' requires LLVM 3.7 or later");
+  OK = false;
+  return 0;
+}
+
+bool ThinLTOIndex::importFunctions(size_t, std::string &) const {
+  errmsg("'-thin-lto' requires LLVM 3.7 or later");
+  return false;
+}
+
+#endif
@@ -0,0 +1,106 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include "threadpool.h"
+
+// ThreadPool -> Public
+
+ThreadPool::ThreadPool(unsigned NumThreads) : Stop(false) {
+  for (unsigned I = 0; I < NumThreads; ++I)
+    Threads.emplace_back([this] { work(); });
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Stop = true;
+  }
+
+  TaskAvailable.notify_all();
+
+  for (auto &Thread : Threads)
+    Thread.join();
+}
+
+void ThreadPool::async(std::function<bool()> Task, unsigned long ID) {
+  {
+    std::lock_guard<std::mutex> Guard(Lock);
+    Tasks.emplace_back(ID, std::move(Task));
+  }
+
+  TaskAvailable.notify_one();
+}
+
+// Waits for any task to finish and returns its result.
+
+bool ThreadPool::wait(unsigned long &ID) {
+  std::unique_lock<std::mutex> Guard(Lock);
+  TaskDone.wait(Guard, [this] { return !Results.empty(); });
+
+  ID = Results.front().first;
+  bool OK = Results.front().second;
+  Results.pop_front();
+  return OK;
+}
+
+// Like wait(), but returns false instead of blocking if no task has
+// finished yet.
+
+bool ThreadPool::tryWait(unsigned long &ID, bool &OK) {
+  std::lock_guard<std::mutex> Guard(Lock);
+
+  if (Results.empty())
+    return false;
+
+  ID = Results.front().first;
+  OK = Results.front().second;
+  Results.pop_front();
+  return true;
+}
+
+// ThreadPool -> Private
+
+void ThreadPool::work() {
+  while (true) {
+    std::pair<unsigned long, std::function<bool()>> Task;
+
+    {
+      std::unique_lock<std::mutex> Guard(Lock);
+      TaskAvailable.wait(Guard, [this] { return Stop || !Tasks.empty(); });
+
+      if (Tasks.empty())
+        return;
+
+      Task = std::move(Tasks.front());
+      Tasks.pop_front();
+    }
+
+    bool OK = Task.second();
+
+    {
+      std::lock_guard<std::mutex> Guard(Lock);
+      Results.emplace_back(Task.first, OK);
+    }
+
+    TaskDone.notify_one();
+  }
+}
@@ -0,0 +1,276 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+#include <chrono>
+#include <cstring>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+#include <llvm/Support/Format.h>
+
+#include "bc2obj.h"
+
+namespace {
+
+JobStats *Stats;
+std::chrono::steady_clock::time_point StartTime;
+
+const char *PhaseNames[NUM_PHASES] = {"parse", "setup", "optimize", "codegen",
+                                      "write"};
+
+double getWallTime() {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       StartTime).count();
+}
+
+double getCPUTime() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+  // Per thread, so that this works for the thread engine as well.
+  struct timespec TS;
+
+  if (!clock_gettime(CLOCK_THREAD_CPUTIME_ID, &TS))
+    return TS.tv_sec + TS.tv_nsec / 1e9;
+#endif
+  return 0;
+}
+
+uint64_t getPeakRSS() {
+#ifndef _WIN32
+  struct rusage Usage;
+
+  if (getrusage(RUSAGE_SELF, &Usage))
+    return 0;
+
+#ifdef __APPLE__
+  return Usage.ru_maxrss;
+#else
+  return uint64_t(Usage.ru_maxrss) * 1024;
+#endif
+#else
+  return 0;
+#endif
+}
+
+void writeString(raw_ostream &OS, StringRef Str) {
+  OS << '"';
+
+  for (char C : Str) {
+    if (C == '"' || C == '\\')
+      OS << '\\' << C;
+    else if ((unsigned char)C < 0x20)
+      OS << format("\\u%04x", C);
+    else
+      OS << C;
+  }
+
+  OS << '"';
+}
+
+void writePhase(raw_ostream &OS, double Wall, double CPU,
+                const uint64_t *Counters) {
+  OS << "{\"wall\": " << format("%.6f", Wall)
+     << ", \"cpu\": " << format("%.6f", CPU);
+
+  switch (getCounterSource()) {
+  case COUNTERS_PERF_EVENT:
+    for (unsigned Counter = 0; Counter < NUM_COUNTERS; ++Counter)
+      OS << ", \"" << CounterNames[Counter] << "\": " << Counters[Counter];
+
+    // Low IPC and many cache misses per instruction: memory bound.
+    if (Counters[COUNTER_CYCLES])
+      OS << ", \"ipc\": "
+         << format("%.3f", double(Counters[COUNTER_INSTRUCTIONS]) /
+                               Counters[COUNTER_CYCLES]);
+    break;
+  case COUNTERS_RUSAGE:
+    OS << ", \"" << CounterNames[COUNTER_PAGE_FAULTS]
+       << "\": " << Counters[COUNTER_PAGE_FAULTS];
+    break;
+  case COUNTERS_NONE:
+    break;
+  }
+
+  OS << '}';
+}
+
+} // end unnamed namespace
+
+bool initTimeReport(size_t NumEntries) {
+  StartTime = std::chrono::steady_clock::now();
+
+  if (TimeReport.empty()) {
+    if (PerfCounters)
+      errmsg("'-perf-counters' has no effect without '-time-report'");
+    return true;
+  }
+
+  if (PerfCounters)
+    initPerfCounters();
+
+  Stats = static_cast<JobStats *>(
+      allocSharedMemory(sizeof(JobStats) * std::max<size_t>(NumEntries, 1)));
+
+  return true;
+}
+
+JobStats *getJobStats(size_t Index) { return Stats ? &Stats[Index] : nullptr; }
+
+void finishJobStats(JobStats *Stats) {
+  if (!Stats)
+    return;
+
+  Stats->PeakRSS = getPeakRSS();
+}
+
+void setJobStatus(size_t Index, bool OK) {
+  if (!Stats)
+    return;
+
+  Stats[Index].Finished = true;
+  Stats[Index].Failed = !OK;
+}
+
+PhaseTimer::PhaseTimer(JobStats *Stats, JobPhase Phase)
+    : Stats(Stats), Phase(Phase) {
+  if (!Stats)
+    return;
+
+  Wall = getWallTime();
+  CPU = getCPUTime();
+
+  if (PerfCounters)
+    readPerfCounters(Counters);
+}
+
+PhaseTimer::~PhaseTimer() {
+  if (!Stats)
+    return;
+
+  Stats->Wall[Phase] += getWallTime() - Wall;
+  Stats->CPU[Phase] += getCPUTime() - CPU;
+
+  if (PerfCounters) {
+    uint64_t Now[NUM_COUNTERS];
+    readPerfCounters(Now);
+
+    for (unsigned Counter = 0; Counter < NUM_COUNTERS; ++Counter)
+      Stats->Counters[Phase][Counter] += Now[Counter] - Counters[Counter];
+  }
+}
+
+bool writeTimeReport(const std::vector<ReportEntry> &Entries) {
+  if (!Stats)
+    return true;
+
+  std::error_code EC;
+  raw_fd_ostream OS(TimeReport, EC, sys::fs::F_Text);
+
+  if (EC) {
+    errmsg(TimeReport << ": cannot open file for writing");
+    return false;
+  }
+
+  OS << "{\n";
+  OS << "  \"llvm_version\": \"" << LLVM_VERSION_MAJOR << '.'
+     << LLVM_VERSION_MINOR << "\",\n";
+  OS << "  \"engine\": \""
+     << (Engine == THREAD_ENGINE    ? "thread"
+         : Engine == PREFORK_ENGINE ? "prefork"
+                                    : "fork")
+     << "\",\n";
+  OS << "  \"jobs\": " << NumJobs << ",\n";
+  OS << "  \"wall\": " << format("%.6f", getWallTime()) << ",\n";
+
+  // Threads share one address space, peak RSS is per process then, and
+  // a worker of -engine=prefork reports its own peak so far.
+  OS << "  \"peak_rss_per\": \""
+     << (Engine == THREAD_ENGINE    ? "process"
+         : Engine == PREFORK_ENGINE ? "worker"
+                                    : "job")
+     << "\",\n";
+
+  CounterSource Source = getCounterSource();
+
+  if (Source != COUNTERS_NONE)
+    OS << "  \"counters\": \""
+       << (Source == COUNTERS_PERF_EVENT ? "perf_event" : "rusage") << "\",\n";
+
+  OS << "  \"modules\": [";
+
+  JobStats Total;
+  memset(&Total, 0, sizeof(Total));
+
+  for (size_t I = 0; I < Entries.size(); ++I) {
+    const ReportEntry &Entry = Entries[I];
+    const JobStats &Job = Stats[I];
+
+    OS << (I ? ",\n" : "\n") << "    {\"name\": ";
+    writeString(OS, Entry.Name);
+    OS << ", \"input_size\": " << Entry.InputSize;
+
+    if (Entry.Reused) {
+      OS << ", \"reused\": true}";
+      continue;
+    }
+
+    if (Entry.Passthrough) {
+      OS << ", \"passthrough\": true}";
+      continue;
+    }
+
+    OS << ", \"status\": \""
+       << (!Job.Finished ? "not run" : Job.Failed ? "failed" : "ok") << '"';
+    OS << ", \"cache_hit\": " << (Job.CacheHit ? "true" : "false");
+    OS << ", \"output_size\": " << Job.OutputSize;
+    OS << ", \"peak_rss\": " << Job.PeakRSS;
+    OS << ",\n     \"phases\": {";
+
+    for (unsigned Phase = 0; Phase < NUM_PHASES; ++Phase) {
+      OS << (Phase ? ", " : "") << '"' << PhaseNames[Phase] << "\": ";
+      writePhase(OS, Job.Wall[Phase], Job.CPU[Phase], Job.Counters[Phase]);
+
+      Total.Wall[Phase] += Job.Wall[Phase];
+      Total.CPU[Phase] += Job.CPU[Phase];
+
+      for (unsigned Counter = 0; Counter < NUM_COUNTERS; ++Counter)
+        Total.Counters[Phase][Counter] += Job.Counters[Phase][Counter];
+    }
+
+    OS << "}}";
+  }
+
+  OS << "\n  ],\n";
+
+  // Summed over all modules that went through codegen.
+  OS << "  \"totals\": {";
+
+  for (unsigned Phase = 0; Phase < NUM_PHASES; ++Phase) {
+    OS << (Phase ? ",\n" : "\n") << "    \"" << PhaseNames[Phase] << "\": ";
+    writePhase(OS, Total.Wall[Phase], Total.CPU[Phase], Total.Counters[Phase]);
+  }
+
+  OS << "\n  }\n}\n";
+  return true;
+}
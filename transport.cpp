@@ -0,0 +1,153 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// Objects of forked jobs (-engine=fork and prefork) go back to the
+// parent through anonymous shared memory files: a memfd on Linux, an
+// unlinked POSIX shared memory object elsewhere. The parent creates one
+// per object right before the job runs, the job writes the object into
+// it and the parent maps it once the job is done. Nothing touches the
+// disk, which matters for build directories on network file systems.
+
+#include <cstdio>
+#include <cstring>
+
+#include "bc2obj.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace {
+
+bool Available;
+
+#ifndef _WIN32
+
+// Owns the mapping of an object that a job handed back.
+
+class MappedObject : public MemoryBuffer {
+public:
+  MappedObject(void *Start, size_t Length) : Length(Length) {
+    const char *Ptr = static_cast<const char *>(Start);
+    init(Ptr, Ptr + Length, false);
+  }
+
+  ~MappedObject() override {
+    if (Length)
+      munmap(const_cast<char *>(getBufferStart()), Length);
+  }
+
+  BufferKind getBufferKind() const override { return MemoryBuffer_MMap; }
+
+private:
+  size_t Length;
+};
+
+#endif
+
+} // end unnamed namespace
+
+bool initObjectTransport() {
+  int FD = createObjectFD();
+
+  if ((Available = FD != -1))
+    close(FD);
+
+  return Available;
+}
+
+bool hasObjectTransport() { return Available; }
+
+int createObjectFD() {
+#if defined(__linux__) && defined(SYS_memfd_create)
+  const unsigned MFD_CLOEXEC_FLAG = 1; // MFD_CLOEXEC
+
+  return syscall(SYS_memfd_create, "bc2obj-object", MFD_CLOEXEC_FLAG);
+#elif !defined(_WIN32) && !defined(__linux__)
+  static unsigned Counter;
+  char Name[64];
+
+  snprintf(Name, sizeof(Name), "/bc2obj-%d-%u", (int)getpid(), Counter++);
+
+  int FD = shm_open(Name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+  if (FD != -1) {
+    shm_unlink(Name);
+    fcntl(FD, F_SETFD, FD_CLOEXEC);
+  }
+
+  return FD;
+#else
+  return -1;
+#endif
+}
+
+bool writeObjectFD(int FD, const void *Data, size_t Length) {
+#ifndef _WIN32
+  // Shared memory objects can't be written to with write() everywhere.
+  if (ftruncate(FD, Length))
+    return false;
+
+  if (!Length)
+    return true;
+
+  void *Mem = mmap(nullptr, Length, PROT_WRITE, MAP_SHARED, FD, 0);
+
+  if (Mem == MAP_FAILED)
+    return false;
+
+  memcpy(Mem, Data, Length);
+  munmap(Mem, Length);
+  return true;
+#else
+  (void)FD;
+  (void)Data;
+  (void)Length;
+  return false;
+#endif
+}
+
+std::unique_ptr<MemoryBuffer> readObjectFD(int FD) {
+  std::unique_ptr<MemoryBuffer> Buf;
+
+#ifndef _WIN32
+  struct stat Stat;
+  void *Mem = nullptr;
+
+  if (!fstat(FD, &Stat)) {
+    if (!Stat.st_size)
+      Buf.reset(new MappedObject(nullptr, 0));
+    else if ((Mem = mmap(nullptr, Stat.st_size, PROT_READ, MAP_SHARED, FD,
+                         0)) != MAP_FAILED)
+      Buf.reset(new MappedObject(Mem, Stat.st_size));
+  }
+#endif
+
+  close(FD);
+  return Buf;
+}
@@ -0,0 +1,227 @@
+/*
+  Copyright (c) 2015 Thomas Poechtrager (t.poechtrager@gmail.com)
+
+  Permission is hereby granted, free of charge, to any person obtaining a copy
+  of this software and associated documentation files (the "Software"), to deal
+  in the Software without restriction, including without limitation the rights
+  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+  copies of the Software, and to permit persons to whom the Software is
+  furnished to do so, subject to the following conditions:
+
+  The above copyright notice and this permission notice shall be included in
+  all copies or substantial portions of the Software.
+
+  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+  THE SOFTWARE.
+ */
+
+// -variant=<name>:<triple>:<cpu>:<attrs> generates every input once per
+// variant, into <out-dir>/<name>/. Empty fields keep the options of the
+// input. The bitcode is parsed and optimized once, with the options of
+// the input; the variants for the same triple are generated from the
+// optimized module, in parallel. A variant for another triple goes
+// through the whole pipeline on its own.
+
+#include <set>
+
+#include "bc2obj.h"
+#include "threadpool.h"
+
+#include <llvm/Support/MD5.h>
+#include <llvm/Support/Path.h>
+
+namespace {
+std::vector<Variant> Variants;
+} // end unnamed namespace
+
+CodeGenOptions Variant::apply(const CodeGenOptions &Opts) const {
+  CodeGenOptions VariantOpts = Opts;
+
+  if (!Target.empty())
+    VariantOpts.Target = Target;
+  if (!CPU.empty())
+    VariantOpts.CPU = CPU;
+  if (!Attrs.empty())
+    VariantOpts.Attrs = Attrs;
+
+  return VariantOpts;
+}
+
+bool initVariants() {
+  Variants.clear();
+
+  if (VariantSpecs.empty())
+    return true;
+
+#if LLVM_VERSION_GE(3, 7)
+  if (LowMemory) {
+    errmsg("'-variant' can't be combined with '-low-memory'");
+    return false;
+  }
+
+  if (!llvm_is_multithreaded()) {
+    errmsg("'-variant' requires a multithreaded LLVM build");
+    return false;
+  }
+
+  std::set<std::string> Names;
+
+  for (auto &Spec : VariantSpecs) {
+    SmallVector<StringRef, 4> Fields;
+    StringRef(Spec).split(Fields, ":", -1, true);
+
+    StringRef Name = Fields[0];
+
+    if (Fields.size() > 4 || Name.empty() || Name == "." || Name == ".." ||
+        Name.find_first_of("/\\") != StringRef::npos) {
+      errmsg("invalid variant: " << Spec
+                                 << " (expected <name>:<triple>:<cpu>:<attrs>)");
+      return false;
+    }
+
+    if (!Names.insert(Name.str()).second) {
+      errmsg("duplicate variant: " << Name);
+      return false;
+    }
+
+    Variant V;
+    V.Name = Name.str();
+
+    if (Fields.size() > 1)
+      V.Target = Fields[1].str();
+    if (Fields.size() > 2)
+      V.CPU = Fields[2].str();
+    if (Fields.size() > 3)
+      V.Attrs = Fields[3].str();
+
+    // Tells -incremental when a variant has been redefined.
+    MD5 Hash;
+    MD5::MD5Result Result;
+    SmallString<32> Key;
+
+    Hash.update(Spec);
+    Hash.final(Result);
+    MD5::stringifyResult(Result, Key);
+    V.Key = Key.c_str();
+
+    Variants.push_back(std::move(V));
+  }
+
+  return true;
+#else
+  errmsg("'-variant' requires LLVM 3.7 or later");
+  return false;
+#endif
+}
+
+const std::vector<Variant> &getVariants() { return Variants; }
+
+unsigned getVariantSlots() {
+  if (Variants.size() <= 1 || NumJobs <= 1)
+    return 1;
+
+  return std::min<unsigned>(Variants.size(), NumJobs);
+}
+
+std::string getVariantPath(const std::string &OutPath, size_t Index) {
+  StringRef Root = OutDir;
+  StringRef Path = OutPath;
+  std::string VariantPath;
+
+  // <out-dir>/<name>/<path below out-dir>, or next to an output
+  // elsewhere (-inputs).
+  if (Path.startswith(Root) && Path.size() > Root.size() &&
+      sys::path::is_separator(Path[Root.size()])) {
+    VariantPath = Root.str();
+    VariantPath += PATH_DIV;
+    VariantPath += Variants[Index].Name;
+    VariantPath += Path.substr(Root.size());
+  } else {
+    VariantPath = sys::path::parent_path(Path).str();
+
+    if (!VariantPath.empty())
+      VariantPath += PATH_DIV;
+
+    VariantPath += Variants[Index].Name;
+    VariantPath += PATH_DIV;
+    VariantPath += sys::path::filename(Path);
+  }
+
+  return VariantPath;
+}
+
+#if LLVM_VERSION_GE(3, 7)
+
+bool compileVariants(LTOCodeGenerator &CodeGen, const std::string &Path,
+                     StringRef Data, const std::string &TripleStr,
+                     const CodeGenOptions &Opts,
+                     std::vector<std::unique_ptr<MemoryBuffer>> &Objects,
+                     std::string &errMsg) {
+  // The optimized module is only reachable through writeMergedModules().
+  SmallString<128> MergedPath;
+
+  if (sys::fs::createTemporaryFile("bc2obj", "bc", MergedPath)) {
+    errMsg = "cannot create temporary file";
+    return false;
+  }
+
+  FileRemover MergedRemover(MergedPath);
+
+  if (!CodeGen.writeMergedModules(MergedPath.c_str(), errMsg))
+    return false;
+
+  auto Merged = MemoryBuffer::getFile(MergedPath);
+
+  if (std::error_code EC = Merged.getError()) {
+    errMsg = EC.message();
+    return false;
+  }
+
+  StringRef Optimized = Merged.get()->getBuffer();
+  // Don't run more threads than the job has been admitted for.
+  ThreadPool Pool(std::min<size_t>(Variants.size(), JobSlots));
+
+  Objects.resize(Variants.size());
+
+  for (size_t I = 0; I < Variants.size(); ++I) {
+    Pool.async([&, I] {
+      CodeGenOptions VariantOpts = Variants[I].apply(Opts);
+      bool SameTarget =
+          Variants[I].Target.empty() || Variants[I].Target == TripleStr;
+
+      NativeCodeGenerator NCodeGen(Path, SameTarget ? Optimized : Data);
+      NCodeGen.setOptions(VariantOpts);
+      NCodeGen.setVariant();
+
+      if (SameTarget)
+        NCodeGen.setPartition(); // already optimized
+
+      if (!NCodeGen.generateNativeCodeMemory())
+        return false;
+
+      Objects[I] = std::move(NCodeGen.takeCode().CodeBuf);
+      return !!Objects[I];
+    }, I);
+  }
+
+  bool OK = true;
+
+  for (size_t I = 0; I < Variants.size(); ++I) {
+    unsigned long ID;
+    OK &= Pool.wait(ID);
+  }
+
+  if (!OK) {
+    errMsg = "code generation of a variant failed";
+    return false;
+  }
+
+  return true;
+}
+
+#endif